@@ -3,19 +3,84 @@
  * Based on MiniGBS: https://github.com/baines/MiniGBS
  */
 
+ #include <limits.h>
  #include <math.h>
+ #include <stdatomic.h>
  #include <stdbool.h>
  #include <stdint.h>
+ #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
+ #include <time.h>
  
  #include "apu.h"
  
+ #if defined(__x86_64__) || defined(__i386__)
+ #define APU_SIMD_X86 1
+ #include <immintrin.h>
+ #else
+ #define APU_SIMD_X86 0
+ #endif
  
  /* Enable high-pass filter */
  #define ENABLE_HIPASS 1
  
- #define AUDIO_NSAMPLES ((unsigned) (AUDIO_SAMPLE_RATE / VERTICAL_SYNC) * 2)
+ /* Run the classic synthesis in integers instead, off channel timers and the
+  * frame sequencer counted in CPU cycles (build with -DAPU_FIXED_POINT=1)
+  */
+ #ifndef APU_FIXED_POINT
+ #define APU_FIXED_POINT 0
+ #endif
+ 
+ /* Stereo frames synthesised in one go */
+ #define SYNTH_BLOCK 1024
+ 
+ /* High-pass filter: how much of the capacitor's charge is kept each frame */
+ #define HIPASS_KEEP 0.996f
+ 
+ /* Register writes the synthesis hasn't reached yet */
+ #define WRITE_LOG_SIZE 4096
+ 
+ /* Band-limited step: taps per edge and fractional positions tabulated */
+ #define BLEP_WIDTH 16
+ #define BLEP_PHASES 32
+ 
+ /* Output resampler: input frames per output frame, fractional positions
+  * tabulated, and how far the device's rate may be from ours either way.
+  */
+ #define RESAMPLE_TAPS 32
+ #define RESAMPLE_PHASES 256
+ #define RESAMPLE_MAX_RATIO 4
+ 
+ /* CPU cycles per frame sequencer step, 512 Hz */
+ #define SEQ_PERIOD 8192
+ 
+ /* Output frames per emulated cycle, at the nominal rate */
+ #define SAMPLES_PER_CYCLE (AUDIO_SAMPLE_RATE / DMG_CLOCK_FREQ)
+ 
+ /* Rate control: the most the ratio may move either way, the proportional
+  * gain on the fill error (in video frames of audio) and the integral gain
+  * per video frame, and how fast the fill reading is smoothed. The gains
+  * settle a step in the queue or a drift of the device's clock within about
+  * five seconds, whatever the target. The target is kept to at least the
+  * audio synthesised at once, plus the device's buffer, which the callback
+  * takes at once, plus DRC_SLACK_MS for callback jitter.
+  */
+ #define DRC_MAX_ADJUST 0.005
+ #define DRC_P 0.03
+ #define DRC_I 0.0002
+ #define DRC_SMOOTHING 0.05
+ #define DRC_SLACK_MS 4.0
+ 
+ /* Adaptive latency: the margin grows by half on an underrun, up to
+  * LATENCY_MAX_MS, and gives a tenth back after LATENCY_STABLE_FRAMES video
+  * frames without one. Callback jitter is smoothed by JITTER_SMOOTHING.
+  */
+ #define LATENCY_GROW 1.5
+ #define LATENCY_SHRINK 0.9
+ #define LATENCY_MAX_MS 40.0
+ #define LATENCY_STABLE_FRAMES 600
+ #define JITTER_SMOOTHING 0.05
  
  #define AUDIO_MEM_SIZE (0xFF3F - 0xFF10 + 1)
  #define AUDIO_ADDR_COMPENSATION 0xFF10
@@ -91,15 +156,465 @@
  
  static float vol_l, vol_r;
  
- static float hipass(struct chan *c, float sample)
+ /* Register writes from the emulation thread, stamped with the emulated cycle
+  * they happened on. Synthesis applies each one at the sample it falls on.
+  */
+ static struct apu_write {
+     uint64_t cycle;
+     uint16_t addr;
+     uint8_t val;
+ } write_log[WRITE_LOG_SIZE];
+ static unsigned write_count;
+ 
+ /* Output frames synthesised since audio_init() */
+ static uint64_t synth_pos;
+ 
+ /* Emulated time maps to output frames through the current ratio: cycle
+  * "synth_cycle" fell on (fractional) frame "synth_time", later cycles are
+  * "samples_per_cycle" further on each.
+  */
+ static uint64_t synth_cycle;
+ static double synth_time;
+ static double samples_per_cycle = SAMPLES_PER_CYCLE;
+ 
+ /* Dynamic rate control, run on the emulation thread. The stats are read
+  * from others.
+  */
+ static struct {
+     bool on;
+     double target;      /* Frames to keep queued */
+     double floor;       /* Least target that can't underrun */
+     double chunk;       /* Most frames one audio_run() adds */
+     double fill;        /* Smoothed queued_frames() */
+     double integral;    /* Settles on minus the clock drift */
+ } drc;
+ static atomic_llong callback_ns;     /* When the callback last ran */
+ static atomic_uint callback_frames;  /* and how much it handed the device */
+ static _Atomic double drc_latency_ms;
+ static _Atomic double drc_target_ms;
+ static _Atomic double drc_ratio = 1.0;
+ static _Atomic double drc_drift_ppm;
+ 
+ /* Adaptive latency, on top of rate control: the queue target is a slice of
+  * audio, synthesised in one go a few scanlines at a time, plus a margin.
+  */
+ static struct {
+     bool on;
+     double min;         /* Margin asked for, in frames */
+     double margin;      /* Margin kept now */
+     unsigned underruns; /* Underruns already answered */
+     unsigned stable;    /* Video frames since the margin last changed */
+ } adapt;
+ 
+ /* Buffer health, counted once synthesis has put anything in the ring */
+ static atomic_bool streaming;
+ static atomic_uint underruns;  /* Callbacks the ring couldn't fill */
+ static atomic_uint overruns;   /* Blocks the full ring dropped frames of */
+ static _Atomic double jitter_ms;      /* Smoothed callback period error */
+ static _Atomic double jitter_max_ms;  /* and the worst one */
+ 
+ static int synthesis = AUDIO_SYNTH_CLASSIC;
+ static audio_sink sink; /* Takes the blocks instead of the ring when set */
+ static unsigned decimation = 1; /* Video frames of output per one heard, 0 for none */
+ 
+ /* Band-limited synthesis state. Each channel's output level changes are
+  * added as deltas, spread by the step kernel, and the sum of all channels is
+  * integrated once. Everything comes out BLEP_WIDTH frames late.
+  */
+ static float blep_kernel[BLEP_PHASES + 1][BLEP_WIDTH];
+ static float blep_delta[2][SYNTH_BLOCK + BLEP_WIDTH];
+ static struct {
+     float edge;      /* Frames from the block start to the next waveform step */
+     float amp[2];    /* Left and right level last put into the deltas */
+ } blep_chan[4];
+ static float blep_sum[2];
+ static float blep_capacitor[2];
+ 
+ /* Single producer, single consumer ring of stereo frames between synthesis
+  * on the emulation thread and the audio callback.
+  */
+ static float ring[AUDIO_RING_FRAMES * 2];
+ static atomic_uint ring_head; /* Next frame synthesis writes */
+ static atomic_uint ring_tail; /* Next frame the callback reads */
+ 
+ /* Synthesis runs at AUDIO_SAMPLE_RATE whatever the device does; for other
+  * device rates every block goes through a polyphase windowed sinc on its
+  * way out. Frames of the ring, the sink and the callback are the device's.
+  */
+ static _Atomic double device_rate = AUDIO_SAMPLE_RATE;
+ static _Alignas(32) float resample_kernel[RESAMPLE_PHASES + 1][RESAMPLE_TAPS];
+ static struct {
+     bool on;
+     double step;    /* Input frames per output frame */
+     double pos;     /* Next output frame's window start in the history */
+     unsigned have;  /* Input frames held */
+     float hist[2][RESAMPLE_TAPS + SYNTH_BLOCK]; /* Left and right apart */
+ } resampler;
+ 
+ /* Block kernels for the classic mixer. Every channel renders a mono block,
+  * which is high-passed on its own capacitor and then panned into the stereo
+  * block with master volume folded into the gains. The SSE2/AVX2 versions
+  * are picked at audio_init() depending on what the host CPU has.
+  */
+ static void hipass_block_scalar(float *restrict mono, const unsigned n, float *capacitor)
+ {
+     float cap = *capacitor;
+     for (unsigned i = 0; i < n; ++i) {
+         float out = mono[i] - cap;
+         cap = mono[i] - out * HIPASS_KEEP;
+         mono[i] = out;
+     }
+     *capacitor = cap;
+ }
+ 
+ static void mix_block_scalar(float *restrict stereo, const float *restrict mono,
+                              const unsigned n, const float gain_l, const float gain_r)
  {
- #if ENABLE_HIPASS
-     float out = sample - c->capacitor;
-     c->capacitor = sample - out * 0.996f;
-     return out;
- #else
-     return sample;
+     for (unsigned i = 0; i < n; ++i) {
+         stereo[i * 2 + 0] += mono[i] * gain_l;
+         stereo[i * 2 + 1] += mono[i] * gain_r;
+     }
+ }
+ 
+ /* The fixed point path's mixer: four Q14 mono blocks times Q15 left and
+  * right gains, summed in 32 bits, saturated to 16-bit frames and handed on
+  * as floats.
+  */
+ static void fixed_mix_scalar(float *restrict stereo, const int16_t *const mono[4],
+                              const int16_t gain[4][2], const unsigned n)
+ {
+     for (unsigned i = 0; i < n; ++i) {
+         for (int ch = 0; ch < 2; ++ch) {
+             int32_t sum = 0;
+             for (int c = 0; c < 4; ++c)
+                 sum += mono[c][i] * gain[c][ch];
+             sum = MAX(-32768, MIN(32767, sum >> 14));
+             stereo[i * 2 + ch] = sum * (1.0f / 32768.0f);
+         }
+     }
+ }
+ 
+ /* The resampler's kernel: output frame f is the dot product of the window
+  * of input frames from at[f] with the kernel at fractional offset phase[f]
+  * + frac[f], interpolated between the two tabulated phases either side.
+  */
+ static void resample_block_scalar(float *restrict stereo, const unsigned count,
+                                   const uint32_t *at, const uint16_t *phase, const float *frac)
+ {
+     for (unsigned f = 0; f < count; ++f) {
+         const float *k0 = resample_kernel[phase[f]];
+         const float *k1 = resample_kernel[phase[f] + 1];
+         const float *l = resampler.hist[0] + at[f];
+         const float *r = resampler.hist[1] + at[f];
+         float sum_l = 0.0f, sum_r = 0.0f;
+         for (int j = 0; j < RESAMPLE_TAPS; ++j) {
+             float k = k0[j] + frac[f] * (k1[j] - k0[j]);
+             sum_l += k * l[j];
+             sum_r += k * r[j];
+         }
+         stereo[f * 2 + 0] = sum_l;
+         stereo[f * 2 + 1] = sum_r;
+     }
+ }
+ 
+ /* The filter is a one-pole recursion, cap' = (1 - k) * in + k * cap, so a
+  * vector of W capacitor values follows from the previous one and W inputs:
+  * cap[j] = k^(j+1) * cap_prev + sum over i <= j of (1 - k) * k^(j-i) * in[i].
+  * hipass_cols[i] holds the weights of in[i] for every j, hipass_carry the
+  * k^(j+1). Each output takes its input less the capacitor one frame back.
+  */
+ static float hipass_cols[8][8];
+ static float hipass_carry[8];
+ 
+ static void hipass_init(void)
+ {
+     for (int j = 0; j < 8; ++j) {
+         hipass_carry[j] = powf(HIPASS_KEEP, j + 1);
+         for (int i = 0; i < 8; ++i)
+             hipass_cols[i][j] = i <= j ? (1.0f - HIPASS_KEEP) * powf(HIPASS_KEEP, j - i) : 0.0f;
+     }
+ }
+ 
+ #if APU_SIMD_X86
+ 
+ __attribute__((target("sse2")))
+ static void hipass_block_sse2(float *restrict mono, const unsigned n, float *capacitor)
+ {
+     const __m128 carry = _mm_loadu_ps(hipass_carry);
+     __m128 prev = _mm_set1_ps(*capacitor);
+     unsigned i = 0;
+ 
+     for (; i + 4 <= n; i += 4) {
+         __m128 in = _mm_loadu_ps(mono + i);
+         __m128 cap = _mm_mul_ps(carry, prev);
+         for (int j = 0; j < 4; ++j)
+             cap = _mm_add_ps(cap, _mm_mul_ps(_mm_load1_ps(mono + i + j), _mm_loadu_ps(hipass_cols[j])));
+ 
+         /* [prev, cap0, cap1, cap2] */
+         __m128 before = _mm_move_ss(_mm_shuffle_ps(cap, cap, _MM_SHUFFLE(2, 1, 0, 3)), prev);
+         _mm_storeu_ps(mono + i, _mm_sub_ps(in, before));
+         prev = _mm_shuffle_ps(cap, cap, _MM_SHUFFLE(3, 3, 3, 3));
+     }
+     *capacitor = _mm_cvtss_f32(prev);
+     hipass_block_scalar(mono + i, n - i, capacitor);
+ }
+ 
+ __attribute__((target("sse2")))
+ static void mix_block_sse2(float *restrict stereo, const float *restrict mono,
+                            const unsigned n, const float gain_l, const float gain_r)
+ {
+     const __m128 gl = _mm_set1_ps(gain_l);
+     const __m128 gr = _mm_set1_ps(gain_r);
+     unsigned i = 0;
+ 
+     for (; i + 4 <= n; i += 4) {
+         __m128 m = _mm_loadu_ps(mono + i);
+         __m128 l = _mm_mul_ps(m, gl);
+         __m128 r = _mm_mul_ps(m, gr);
+         float *out = stereo + i * 2;
+         _mm_storeu_ps(out + 0, _mm_add_ps(_mm_loadu_ps(out + 0), _mm_unpacklo_ps(l, r)));
+         _mm_storeu_ps(out + 4, _mm_add_ps(_mm_loadu_ps(out + 4), _mm_unpackhi_ps(l, r)));
+     }
+     mix_block_scalar(stereo + i * 2, mono + i, n - i, gain_l, gain_r);
+ }
+ 
+ __attribute__((target("avx2")))
+ static void hipass_block_avx2(float *restrict mono, const unsigned n, float *capacitor)
+ {
+     const __m256 carry = _mm256_loadu_ps(hipass_carry);
+     const __m256i rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+     __m256 prev = _mm256_set1_ps(*capacitor);
+     unsigned i = 0;
+ 
+     for (; i + 8 <= n; i += 8) {
+         __m256 in = _mm256_loadu_ps(mono + i);
+         __m256 cap = _mm256_mul_ps(carry, prev);
+         for (int j = 0; j < 8; ++j)
+             cap = _mm256_add_ps(cap, _mm256_mul_ps(_mm256_broadcast_ss(mono + i + j), _mm256_loadu_ps(hipass_cols[j])));
+ 
+         /* [prev, cap0, ..., cap6] */
+         __m256 before = _mm256_blend_ps(_mm256_permutevar8x32_ps(cap, rotate), prev, 0x01);
+         _mm256_storeu_ps(mono + i, _mm256_sub_ps(in, before));
+         prev = _mm256_permutevar8x32_ps(cap, _mm256_set1_epi32(7));
+     }
+     *capacitor = _mm256_cvtss_f32(prev);
+     hipass_block_scalar(mono + i, n - i, capacitor);
+ }
+ 
+ __attribute__((target("avx2")))
+ static void mix_block_avx2(float *restrict stereo, const float *restrict mono,
+                            const unsigned n, const float gain_l, const float gain_r)
+ {
+     const __m256 gl = _mm256_set1_ps(gain_l);
+     const __m256 gr = _mm256_set1_ps(gain_r);
+     unsigned i = 0;
+ 
+     for (; i + 8 <= n; i += 8) {
+         __m256 m = _mm256_loadu_ps(mono + i);
+         __m256 l = _mm256_mul_ps(m, gl);
+         __m256 r = _mm256_mul_ps(m, gr);
+         /* Unpacking works within 128 bit lanes: frames 0-1, 4-5 and 2-3, 6-7 */
+         __m256 lo = _mm256_unpacklo_ps(l, r);
+         __m256 hi = _mm256_unpackhi_ps(l, r);
+         float *out = stereo + i * 2;
+         _mm256_storeu_ps(out + 0, _mm256_add_ps(_mm256_loadu_ps(out + 0), _mm256_permute2f128_ps(lo, hi, 0x20)));
+         _mm256_storeu_ps(out + 8, _mm256_add_ps(_mm256_loadu_ps(out + 8), _mm256_permute2f128_ps(lo, hi, 0x31)));
+     }
+     mix_block_scalar(stereo + i * 2, mono + i, n - i, gain_l, gain_r);
+ }
+ 
+ /* Two channels' gains for pmaddwd against their interleaved samples */
+ static inline int32_t gain_pair(const int16_t gain[4][2], const int c, const int ch)
+ {
+     return (int32_t) ((uint16_t) gain[c][ch] | ((uint32_t) (uint16_t) gain[c + 1][ch] << 16));
+ }
+ 
+ __attribute__((target("sse2")))
+ static void fixed_mix_sse2(float *restrict stereo, const int16_t *const mono[4],
+                            const int16_t gain[4][2], const unsigned n)
+ {
+     const __m128i gl01 = _mm_set1_epi32(gain_pair(gain, 0, 0));
+     const __m128i gl23 = _mm_set1_epi32(gain_pair(gain, 2, 0));
+     const __m128i gr01 = _mm_set1_epi32(gain_pair(gain, 0, 1));
+     const __m128i gr23 = _mm_set1_epi32(gain_pair(gain, 2, 1));
+     const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+     unsigned i = 0;
+ 
+     for (; i + 8 <= n; i += 8) {
+         __m128i m[4];
+         for (int c = 0; c < 4; ++c)
+             m[c] = _mm_loadu_si128((const __m128i *) (mono[c] + i));
+ 
+         /* Frames 0-3 and 4-7, channels side by side */
+         __m128i c01[2] = {_mm_unpacklo_epi16(m[0], m[1]), _mm_unpackhi_epi16(m[0], m[1])};
+         __m128i c23[2] = {_mm_unpacklo_epi16(m[2], m[3]), _mm_unpackhi_epi16(m[2], m[3])};
+         __m128i l[2], r[2];
+         for (int h = 0; h < 2; ++h) {
+             l[h] = _mm_add_epi32(_mm_madd_epi16(c01[h], gl01), _mm_madd_epi16(c23[h], gl23));
+             r[h] = _mm_add_epi32(_mm_madd_epi16(c01[h], gr01), _mm_madd_epi16(c23[h], gr23));
+             l[h] = _mm_srai_epi32(l[h], 14);
+             r[h] = _mm_srai_epi32(r[h], 14);
+         }
+         __m128i left = _mm_packs_epi32(l[0], l[1]);
+         __m128i right = _mm_packs_epi32(r[0], r[1]);
+ 
+         /* Interleave, widen back to 32 bits and store as floats */
+         __m128i lr[2] = {_mm_unpacklo_epi16(left, right), _mm_unpackhi_epi16(left, right)};
+         float *out = stereo + i * 2;
+         for (int h = 0; h < 2; ++h) {
+             __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(lr[h], lr[h]), 16);
+             __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(lr[h], lr[h]), 16);
+             _mm_storeu_ps(out + h * 8 + 0, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+             _mm_storeu_ps(out + h * 8 + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+         }
+     }
+     const int16_t *const rest[4] = {mono[0] + i, mono[1] + i, mono[2] + i, mono[3] + i};
+     fixed_mix_scalar(stereo + i * 2, rest, gain, n - i);
+ }
+ 
+ __attribute__((target("avx2")))
+ static void fixed_mix_avx2(float *restrict stereo, const int16_t *const mono[4],
+                            const int16_t gain[4][2], const unsigned n)
+ {
+     const __m256i gl01 = _mm256_set1_epi32(gain_pair(gain, 0, 0));
+     const __m256i gl23 = _mm256_set1_epi32(gain_pair(gain, 2, 0));
+     const __m256i gr01 = _mm256_set1_epi32(gain_pair(gain, 0, 1));
+     const __m256i gr23 = _mm256_set1_epi32(gain_pair(gain, 2, 1));
+     const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+     unsigned i = 0;
+ 
+     for (; i + 16 <= n; i += 16) {
+         __m256i m[4];
+         for (int c = 0; c < 4; ++c)
+             m[c] = _mm256_loadu_si256((const __m256i *) (mono[c] + i));
+ 
+         /* Unpacking and packing stay within 128 bit lanes, so after a round
+          * of each the lanes hold frames 0-7 and 8-15 again.
+          */
+         __m256i c01[2] = {_mm256_unpacklo_epi16(m[0], m[1]), _mm256_unpackhi_epi16(m[0], m[1])};
+         __m256i c23[2] = {_mm256_unpacklo_epi16(m[2], m[3]), _mm256_unpackhi_epi16(m[2], m[3])};
+         __m256i l[2], r[2];
+         for (int h = 0; h < 2; ++h) {
+             l[h] = _mm256_add_epi32(_mm256_madd_epi16(c01[h], gl01), _mm256_madd_epi16(c23[h], gl23));
+             r[h] = _mm256_add_epi32(_mm256_madd_epi16(c01[h], gr01), _mm256_madd_epi16(c23[h], gr23));
+             l[h] = _mm256_srai_epi32(l[h], 14);
+             r[h] = _mm256_srai_epi32(r[h], 14);
+         }
+         __m256i left = _mm256_packs_epi32(l[0], l[1]);
+         __m256i right = _mm256_packs_epi32(r[0], r[1]);
+ 
+         /* Frames 0-3 and 8-11, then 4-7 and 12-15, as left/right pairs */
+         __m256i lr[2] = {_mm256_unpacklo_epi16(left, right), _mm256_unpackhi_epi16(left, right)};
+         const __m128i quarters[4] = {
+             _mm256_castsi256_si128(lr[0]), _mm256_castsi256_si128(lr[1]),
+             _mm256_extracti128_si256(lr[0], 1), _mm256_extracti128_si256(lr[1], 1)
+         };
+         float *out = stereo + i * 2;
+         for (int q = 0; q < 4; ++q) {
+             __m256 frames = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(quarters[q]));
+             _mm256_storeu_ps(out + q * 8, _mm256_mul_ps(frames, scale));
+         }
+     }
+     const int16_t *const rest[4] = {mono[0] + i, mono[1] + i, mono[2] + i, mono[3] + i};
+     fixed_mix_scalar(stereo + i * 2, rest, gain, n - i);
+ }
+ 
+ /* Left and right sums of [l0 l1 l2 l3] and [r0 r1 r2 r3] into frame "out" */
+ __attribute__((target("sse2")))
+ static inline void store_pair_sse2(float *out, const __m128 l, const __m128 r)
+ {
+     __m128 sum = _mm_add_ps(_mm_unpacklo_ps(l, r), _mm_unpackhi_ps(l, r));
+     sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+     _mm_storel_pi((__m64 *) out, sum);
+ }
+ 
+ __attribute__((target("sse2")))
+ static void resample_block_sse2(float *restrict stereo, const unsigned count,
+                                 const uint32_t *at, const uint16_t *phase, const float *frac)
+ {
+     for (unsigned f = 0; f < count; ++f) {
+         const float *k0 = resample_kernel[phase[f]];
+         const float *k1 = resample_kernel[phase[f] + 1];
+         const float *l = resampler.hist[0] + at[f];
+         const float *r = resampler.hist[1] + at[f];
+         const __m128 t = _mm_set1_ps(frac[f]);
+         __m128 sum_l = _mm_setzero_ps(), sum_r = _mm_setzero_ps();
+         for (int j = 0; j < RESAMPLE_TAPS; j += 4) {
+             __m128 a = _mm_load_ps(k0 + j);
+             __m128 k = _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(_mm_load_ps(k1 + j), a)));
+             sum_l = _mm_add_ps(sum_l, _mm_mul_ps(k, _mm_loadu_ps(l + j)));
+             sum_r = _mm_add_ps(sum_r, _mm_mul_ps(k, _mm_loadu_ps(r + j)));
+         }
+         store_pair_sse2(stereo + f * 2, sum_l, sum_r);
+     }
+ }
+ 
+ __attribute__((target("avx2")))
+ static void resample_block_avx2(float *restrict stereo, const unsigned count,
+                                 const uint32_t *at, const uint16_t *phase, const float *frac)
+ {
+     for (unsigned f = 0; f < count; ++f) {
+         const float *k0 = resample_kernel[phase[f]];
+         const float *k1 = resample_kernel[phase[f] + 1];
+         const float *l = resampler.hist[0] + at[f];
+         const float *r = resampler.hist[1] + at[f];
+         const __m256 t = _mm256_set1_ps(frac[f]);
+         __m256 sum_l = _mm256_setzero_ps(), sum_r = _mm256_setzero_ps();
+         for (int j = 0; j < RESAMPLE_TAPS; j += 8) {
+             __m256 a = _mm256_load_ps(k0 + j);
+             __m256 k = _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(_mm256_load_ps(k1 + j), a)));
+             sum_l = _mm256_add_ps(sum_l, _mm256_mul_ps(k, _mm256_loadu_ps(l + j)));
+             sum_r = _mm256_add_ps(sum_r, _mm256_mul_ps(k, _mm256_loadu_ps(r + j)));
+         }
+         store_pair_sse2(stereo + f * 2,
+                         _mm_add_ps(_mm256_castps256_ps128(sum_l), _mm256_extractf128_ps(sum_l, 1)),
+                         _mm_add_ps(_mm256_castps256_ps128(sum_r), _mm256_extractf128_ps(sum_r, 1)));
+     }
+ }
+ 
  #endif
+ 
+ static void (*hipass_block)(float *restrict mono, const unsigned n, float *capacitor) = hipass_block_scalar;
+ static void (*mix_block)(float *restrict stereo, const float *restrict mono,
+                          const unsigned n, const float gain_l, const float gain_r) = mix_block_scalar;
+ static void (*fixed_mix)(float *restrict stereo, const int16_t *const mono[4],
+                          const int16_t gain[4][2], const unsigned n) = fixed_mix_scalar;
+ static void (*resample_block)(float *restrict stereo, const unsigned count, const uint32_t *at,
+                               const uint16_t *phase, const float *frac) = resample_block_scalar;
+ static const char *simd_name = "scalar";
+ 
+ static void simd_init(void)
+ {
+     hipass_init();
+ #if APU_SIMD_X86
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("avx2")) {
+         hipass_block = hipass_block_avx2;
+         mix_block = mix_block_avx2;
+         fixed_mix = fixed_mix_avx2;
+         resample_block = resample_block_avx2;
+         simd_name = "avx2";
+         return;
+     }
+     if (__builtin_cpu_supports("sse2")) {
+         hipass_block = hipass_block_sse2;
+         mix_block = mix_block_sse2;
+         fixed_mix = fixed_mix_sse2;
+         resample_block = resample_block_sse2;
+         simd_name = "sse2";
+         return;
+     }
+ #endif
+     hipass_block = hipass_block_scalar;
+     mix_block = mix_block_scalar;
+     fixed_mix = fixed_mix_scalar;
+     resample_block = resample_block_scalar;
+     simd_name = "scalar";
+ }
+ 
+ const char *audio_simd_name(void)
+ {
+     return simd_name;
  }
  
  static void set_note_freq(struct chan *c, const uint_fast16_t freq)
@@ -118,18 +633,23 @@
      audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] = val;
  }
  
+ static void env_tick(struct chan *c)
+ {
+     if (c->env.step) {
+         c->volume += c->env.up ? 1 : -1;
+         if (c->volume == 0 || c->volume == 15) {
+             c->env.inc = 0;
+         }
+         c->volume = MAX(0, MIN(15, c->volume));
+     }
+ }
+ 
  static void update_env(struct chan *c)
  {
      c->env.counter += c->env.inc;
  
      while (c->env.counter > 1.0f) {
-         if (c->env.step) {
-             c->volume += c->env.up ? 1 : -1;
-             if (c->volume == 0 || c->volume == 15) {
-                 c->env.inc = 0;
-             }
-             c->volume = MAX(0, MIN(15, c->volume));
-         }
+         env_tick(c);
          c->env.counter -= 1.0f;
      }
  }
@@ -160,41 +680,47 @@
      }
  }
  
+ static void sweep_tick(struct chan *c)
+ {
+     if (c->sweep.shift) {
+         uint16_t inc = (c->sweep.freq >> c->sweep.shift);
+         if (!c->sweep.up)
+             inc *= -1;
+ 
+         c->freq += inc;
+         if (c->freq > 2047) {
+             chan_enable(c - chans, 0);
+         } else {
+             set_note_freq(c, 4194304 / ((2048 - c->freq) << 5));
+             c->freq_inc *= 8.0f;
+         }
+     } else if (c->sweep.rate) {
+         chan_enable(c - chans, 0);
+     }
+ }
+ 
  static void update_sweep(struct chan *c)
  {
      c->sweep.counter += c->sweep.inc;
  
      while (c->sweep.counter > 1.0f) {
-         if (c->sweep.shift) {
-             uint16_t inc = (c->sweep.freq >> c->sweep.shift);
-             if (!c->sweep.up)
-                 inc *= -1;
- 
-             c->freq += inc;
-             if (c->freq > 2047) {
-                 c->enabled = 0;
-             } else {
-                 set_note_freq(c, 4194304 / ((2048 - c->freq) << 5));
-                 c->freq_inc *= 8.0f;
-             }
-         } else if (c->sweep.rate) {
-             c->enabled = 0;
-         }
+         sweep_tick(c);
          c->sweep.counter -= 1.0f;
      }
  }
  
- static void update_square(float *restrict samples, const bool ch2)
+ static bool update_square(float *restrict out, const unsigned n, const bool ch2)
  {
      struct chan *c = chans + ch2;
      if (!c->powered)
-         return;
+         return false;
  
      set_note_freq(c, 4194304.0f / ((2048 - c->freq) << 5));
      c->freq_inc *= 8.0f;
  
-     for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+     for (unsigned i = 0; i < n; ++i) {
          update_len(c);
+         out[i] = 0.0f;
  
          if (c->enabled) {
              update_env(c);
@@ -212,14 +738,10 @@
                  prev_pos = pos;
              }
              sample += ((pos - prev_pos) / c->freq_inc) * (float) c->val;
-             sample = hipass(c, sample * (c->volume / 15.0f));
- 
-             if (!c->muted) {
-                 samples[i + 0] += sample * 0.25f * c->on_left * vol_l;
-                 samples[i + 1] += sample * 0.25f * c->on_right * vol_r;
-             }
+             out[i] = sample * (c->volume / 15.0f);
          }
      }
+     return true;
  }
  
  static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
@@ -233,19 +755,20 @@
      return volume ? (sample >> (volume - 1)) : 0;
  }
  
- static void update_wave(float *restrict samples)
+ static bool update_wave(float *restrict out, const unsigned n)
  {
      struct chan *c = chans + 2;
      if (!c->powered)
-         return;
+         return false;
  
      uint_fast16_t freq = 4194304.0f / ((2048 - c->freq) << 5);
      set_note_freq(c, freq);
  
      c->freq_inc *= 16.0f;
  
-     for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+     for (unsigned i = 0; i < n; ++i) {
          update_len(c);
+         out[i] = 0.0f;
  
          if (c->enabled) {
              float pos = 0.0f;
@@ -264,22 +787,18 @@
  
              if (c->volume > 0) {
                  float diff = (float[]){7.5f, 3.75f, 1.5f}[c->volume - 1];
-                 sample = hipass(c, (sample - diff) / 7.5f);
- 
-                 if (!c->muted) {
-                     samples[i + 0] += sample * 0.25f * c->on_left * vol_l;
-                     samples[i + 1] += sample * 0.25f * c->on_right * vol_r;
-                 }
+                 out[i] = (sample - diff) / 7.5f;
              }
          }
      }
+     return true;
  }
  
- static void update_noise(float *restrict samples)
+ static bool update_noise(float *restrict out, const unsigned n)
  {
      struct chan *c = chans + 3;
      if (!c->powered)
-         return;
+         return false;
  
      uint_fast16_t freq =
          4194304 / ((uint_fast8_t[]){8, 16, 32, 48, 64, 80, 96, 112}[c->lfsr_div]
@@ -289,8 +808,9 @@
      if (c->freq >= 14)
          c->enabled = 0;
  
-     for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+     for (unsigned i = 0; i < n; ++i) {
          update_len(c);
+         out[i] = 0.0f;
  
          if (c->enabled) {
              update_env(c);
@@ -317,30 +837,853 @@
                  prev_pos = pos;
              }
              sample += ((pos - prev_pos) / c->freq_inc) * c->val;
-             sample = hipass(c, sample * (c->volume / 15.0f));
+             out[i] = sample * (c->volume / 15.0f);
+         }
+     }
+     return true;
+ }
+ 
+ /* Fill "kernel", phases + 1 rows of "taps", with a Blackman windowed sinc
+  * cut off at "cutoff" of Nyquist. Row p is centred "centre" + p / phases
+  * taps in, and is normalised so it passes DC unchanged. The extra row lets
+  * a caller interpolate from the last phase to the next tap.
+  */
+ static void windowed_sinc(float *kernel, const int phases, const int taps,
+                           const double cutoff, const double centre)
+ {
+     for (int p = 0; p <= phases; ++p) {
+         float *row = kernel + p * taps;
+         double sum = 0.0;
+         for (int j = 0; j < taps; ++j) {
+             double x = j - centre - (double) p / phases;
+             double w = (j + 1 - (double) p / phases) / (taps + 1);
+             double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+             double sinc = x == 0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+             row[j] = (float) (sinc * window);
+             sum += row[j];
+         }
+         for (int j = 0; j < taps; ++j)
+             row[j] /= (float) sum;
+     }
+ }
+ 
+ /* Build the step kernel, cut off a little below Nyquist and sampled at
+  * every tabulated fraction of a frame, so each phase adds exactly the delta.
+  */
+ static void blep_init(void)
+ {
+     windowed_sinc(blep_kernel[0], BLEP_PHASES, BLEP_WIDTH, 0.9, BLEP_WIDTH / 2);
+ 
+     memset(blep_delta, 0, sizeof(blep_delta));
+     memset(blep_chan, 0, sizeof(blep_chan));
+     memset(blep_sum, 0, sizeof(blep_sum));
+     memset(blep_capacitor, 0, sizeof(blep_capacitor));
+ }
+ 
+ /* The level channel "i" is putting out right now, panned. */
+ static void blep_level(const uint_fast8_t i, float *l, float *r)
+ {
+     const struct chan *c = chans + i;
+     float level = 0.0f;
+ 
+     if (c->powered && c->enabled && !c->muted) {
+         if (i == 2) {
+             if (c->volume > 0) {
+                 float diff = (float[]){7.5f, 3.75f, 1.5f}[c->volume - 1];
+                 level = (wave_sample(c->val, c->volume) - diff) / 7.5f;
+             }
+         } else {
+             level = c->val * (c->volume / 15.0f);
+         }
+     }
+     *l = level * 0.25f * c->on_left * vol_l;
+     *r = level * 0.25f * c->on_right * vol_r;
+ }
+ 
+ /* Put channel "i"'s level change, if any, at frame "pos" of the block. */
+ static void blep_update(const uint_fast8_t i, const float pos)
+ {
+     float l, r;
+     blep_level(i, &l, &r);
+ 
+     float dl = l - blep_chan[i].amp[0];
+     float dr = r - blep_chan[i].amp[1];
+     if (dl == 0.0f && dr == 0.0f)
+         return;
+     blep_chan[i].amp[0] = l;
+     blep_chan[i].amp[1] = r;
+ 
+     unsigned at = (unsigned) pos;
+     const float *k = blep_kernel[(unsigned) ((pos - at) * BLEP_PHASES)];
+     for (int j = 0; j < BLEP_WIDTH; ++j) {
+         blep_delta[0][at + j] += dl * k[j];
+         blep_delta[1][at + j] += dr * k[j];
+     }
+ }
+ 
+ /* Emulated cycles between waveform steps of channel "i". */
+ static unsigned chan_period(const uint_fast8_t i)
+ {
+     const struct chan *c = chans + i;
+ 
+     if (i == 3)
+         return (uint_fast8_t[]){8, 16, 32, 48, 64, 80, 96, 112}[c->lfsr_div] << c->freq;
+     return (2048 - c->freq) * (i == 2 ? 2 : 4);
+ }
+ 
+ /* Advance channel "i"'s waveform by one step. */
+ static void chan_step(const uint_fast8_t i)
+ {
+     struct chan *c = chans + i;
+ 
+     if (i == 2) {
+         c->val = (c->val + 1) & 31;
+     } else if (i == 3) {
+         c->lfsr_reg = (c->lfsr_reg << 1) | (c->val == 1);
+         unsigned tap = c->lfsr_wide ? 13 : 5;
+         c->val = !(((c->lfsr_reg >> (tap + 1)) & 1) ^ ((c->lfsr_reg >> tap) & 1)) ? 1 : -1;
+     } else {
+         c->duty_counter = (c->duty_counter + 1) & 7;
+         c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
+     }
+ }
+ 
+ /* Frames until a counter stepping by "inc" each frame from "counter" passes
+  * 1, at most "limit".
+  */
+ static unsigned frames_until(const float counter, const float inc, const unsigned limit)
+ {
+     if (inc <= 0.0f)
+         return limit;
+     float k = floorf((1.0f - counter) / inc) + 1.0f;
+     return k < (float) limit ? MAX((unsigned) k, 1u) : limit;
+ }
+ 
+ /* Frames, at most "limit", until channel "i"'s next length, envelope or
+  * sweep event. Between events its counters change nothing audible.
+  */
+ static unsigned until_event(const uint_fast8_t i, unsigned limit)
+ {
+     const struct chan *c = chans + i;
+ 
+     if (c->len.enabled)
+         limit = frames_until(c->len.counter, c->len.inc, limit);
+     if (i != 2)
+         limit = frames_until(c->env.counter, c->env.inc, limit);
+     if (i == 0)
+         limit = frames_until(c->sweep.counter, c->sweep.inc, limit);
+     return limit;
+ }
+ 
+ /* Run channel "i"'s length, envelope and sweep counters over a stretch of
+  * "k" frames from until_event(), the events due landing on its last frame
+  * as the per frame updates would have them.
+  */
+ static void run_events(const uint_fast8_t i, const unsigned k)
+ {
+     struct chan *c = chans + i;
+ 
+     if (c->len.enabled)
+         c->len.counter += (k - 1) * c->len.inc;
+     update_len(c);
+     if (c->enabled && i != 2) {
+         c->env.counter += (k - 1) * c->env.inc;
+         update_env(c);
+     }
+     if (c->enabled && i == 0) {
+         c->sweep.counter += (k - 1) * c->sweep.inc;
+         update_sweep(c);
+     }
+ }
+ 
+ /* Render channel "i"'s "n" frames as deltas. The block is cut into stretches
+  * between length, envelope and sweep events; inside one the channel only
+  * changes level on its waveform steps, so the work goes with the number of
+  * steps rather than the number of frames.
+  */
+ static void blep_channel(const uint_fast8_t i, const unsigned n)
+ {
+     struct chan *c = chans + i;
+     unsigned t = 0;
+ 
+     if (i == 3 && c->freq >= 14)
+         c->enabled = 0;
+ 
+     while (t < n) {
+         bool active = c->powered && c->enabled;
+         unsigned k = active ? until_event(i, n - t) : n - t;
+ 
+         blep_update(i, t);
+ 
+         float end = t + k;
+         if (active) {
+             float period = chan_period(i) * samples_per_cycle;
+             while (blep_chan[i].edge < end) {
+                 chan_step(i);
+                 blep_update(i, MAX(blep_chan[i].edge, 0.0f));
+                 blep_chan[i].edge += period;
+             }
+         } else if (blep_chan[i].edge < end) {
+             blep_chan[i].edge = end;
+         }
+         t += k;
+         if (active)
+             run_events(i, k);
+     }
+     blep_chan[i].edge -= n;
+ }
+ 
+ /* Band-limited counterpart of the update_* functions: all channels as
+  * deltas, then one integration and high-pass over the mix.
+  */
+ static void blep_render(float *restrict samples, const unsigned n)
+ {
+     for (uint_fast8_t i = 0; i < 4; ++i)
+         blep_channel(i, n);
+ 
+     for (int ch = 0; ch < 2; ++ch) {
+         float sum = blep_sum[ch];
+         float cap = blep_capacitor[ch];
+         for (unsigned i = 0; i < n; ++i) {
+             sum += blep_delta[ch][i];
+             float out = sum - cap;
+             cap = sum - out * HIPASS_KEEP;
+             samples[i * 2 + ch] = out;
+         }
+         blep_sum[ch] = sum;
+         blep_capacitor[ch] = cap;
+ 
+         /* Keep the kernel tails that run into the next block */
+         memmove(blep_delta[ch], blep_delta[ch] + n, BLEP_WIDTH * sizeof(float));
+         memset(blep_delta[ch] + BLEP_WIDTH, 0, n * sizeof(float));
+     }
+ }
+ 
+ /* Integer counterpart of the update_* functions. Each channel's timer
+  * counts down the CPU cycles to its next waveform step, and the frame
+  * sequencer ticks length (256 Hz), sweep (128 Hz) and envelope (64 Hz) off
+  * a 512 Hz step as on hardware. An output frame averages each channel's
+  * level over the cycles it covers; levels are in 60ths of a channel's full
+  * swing, which keeps the wave channel's offsets whole. The high-pass and
+  * the mix are fixed point into 16-bit frames.
+  */
+ static struct {
+     unsigned timer;       /* Cycles to the next waveform step */
+     unsigned len_left;    /* 256 Hz ticks until the length runs out */
+     unsigned env_timer;   /* 64 Hz ticks to the next envelope step */
+     unsigned sweep_timer; /* 128 Hz ticks to the next sweep step */
+     int32_t capacitor;    /* High-pass state, Q22 */
+ } fixed[4];
+ static unsigned seq_timer; /* Cycles to the next sequencer step */
+ static unsigned seq_step;
+ static uint32_t cycle_frac; /* Cycles owed to the next frame, Q16 */
+ 
+ /* 2^22 / (60 * cycles): scales a frame's summed level to Q14 with ">> 8" */
+ static int32_t fixed_recip[256];
+ 
+ static void fixed_init(void)
+ {
+     memset(fixed, 0, sizeof(fixed));
+     seq_timer = SEQ_PERIOD;
+     seq_step = 0;
+     cycle_frac = 0;
+     fixed_recip[0] = 0;
+     for (int n = 1; n < 256; ++n)
+         fixed_recip[n] = (int32_t) ((1 << 22) / (60.0 * n) + 0.5);
+ }
+ 
+ static int fixed_level(const uint_fast8_t i)
+ {
+     const struct chan *c = chans + i;
+ 
+     if (!c->powered || !c->enabled)
+         return 0;
+     if (i == 2) {
+         if (c->volume == 0)
+             return 0;
+         return 8 * wave_sample(c->val, c->volume) - (int[]){60, 30, 12}[c->volume - 1];
+     }
+     return c->val * c->volume * 4;
+ }
+ 
+ /* Run channel "i" for "cycles" CPU cycles, stepping its waveform on the way
+  * and summing its level into "acc". The timer and level are the caller's
+  * copies, so they stay in registers.
+  */
+ static inline void fixed_run(const uint_fast8_t i, unsigned cycles,
+                              unsigned *timer, int *level, int32_t *acc)
+ {
+     while (cycles >= *timer) {
+         cycles -= *timer;
+         *acc += *level * (int32_t) *timer;
+         chan_step(i);
+         *level = fixed_level(i);
+         *timer = chan_period(i);
+     }
+     *acc += *level * (int32_t) cycles;
+     *timer -= cycles;
+ }
  
-             if (!c->muted) {
-                 samples[i + 0] += sample * 0.25f * c->on_left * vol_l;
-                 samples[i + 1] += sample * 0.25f * c->on_right * vol_r;
+ /* Frame sequencer step "step" as channel "i" sees it. */
+ static void fixed_tick(const uint_fast8_t i, const unsigned step)
+ {
+     struct chan *c = chans + i;
+ 
+     if (!(step & 1) && c->len.enabled && fixed[i].len_left && --fixed[i].len_left == 0)
+         chan_enable(i, 0);
+ 
+     if (i == 0 && (step == 2 || step == 6) && c->sweep.inc != 0) {
+         if (fixed[i].sweep_timer > 1) {
+             fixed[i].sweep_timer--;
+         } else {
+             fixed[i].sweep_timer = c->sweep.rate;
+             sweep_tick(c);
+         }
+     }
+ 
+     /* A finished envelope has its increment zeroed, as in update_env() */
+     if (i != 2 && step == 7 && c->env.step && c->env.inc != 0) {
+         if (fixed[i].env_timer > 1) {
+             fixed[i].env_timer--;
+         } else {
+             fixed[i].env_timer = c->env.step;
+             env_tick(c);
+         }
+     }
+ }
+ 
+ /* The block's frame clock and sequencer steps are worked out once, then
+  * each channel runs through the whole block on its own, like the classic
+  * path, into a 16-bit mono block for fixed_mix().
+  */
+ static void fixed_render(float *restrict samples, const unsigned n)
+ {
+     static uint8_t cycles[SYNTH_BLOCK];
+     static int32_t level_sum[SYNTH_BLOCK];
+     static int16_t mono[4][SYNTH_BLOCK];
+     static const int16_t silence[SYNTH_BLOCK];
+     struct {
+         unsigned frame; /* Output frame the step falls in */
+         unsigned at;    /* and how many of its cycles come first */
+     } ticks[SYNTH_BLOCK * 255 / SEQ_PERIOD + 1];
+     unsigned tick_count = 0;
+ 
+     const uint32_t step = (uint32_t) (65536.0 / samples_per_cycle);
+     for (unsigned f = 0; f < n; ++f) {
+         cycle_frac += step;
+         cycles[f] = MIN(cycle_frac >> 16, 255u);
+         cycle_frac &= 0xFFFF;
+ 
+         if (seq_timer <= cycles[f]) {
+             ticks[tick_count].frame = f;
+             ticks[tick_count].at = seq_timer;
+             ++tick_count;
+             seq_timer += SEQ_PERIOD;
+         }
+         seq_timer -= cycles[f];
+     }
+ 
+     /* A quarter of full scale per channel, panned and at master volume, Q15 */
+     const uint8_t nr50 = audio_mem[0xFF24 - AUDIO_ADDR_COMPENSATION];
+     const int master[2] = {(nr50 >> 4) & 7, nr50 & 7};
+     const int16_t *blocks[4];
+     int16_t gain[4][2];
+ 
+     if (chans[3].freq >= 14)
+         chans[3].enabled = 0;
+ 
+     for (uint_fast8_t i = 0; i < 4; ++i) {
+         struct chan *c = chans + i;
+         blocks[i] = silence;
+         gain[i][0] = gain[i][1] = 0;
+         if (!c->powered)
+             continue;
+ 
+         /* Silent all block, with the filter settled: nothing to add */
+         bool on = c->enabled;
+         if (!on && abs(fixed[i].capacitor) < 256) {
+             fixed[i].capacitor = 0;
+             continue;
+         }
+ 
+         unsigned timer = on ? fixed[i].timer : UINT_MAX;
+         int level = fixed_level(i);
+         unsigned next = 0;
+         unsigned f = 0;
+         while (f < n) {
+             /* Frames without a waveform or sequencer step hold the level */
+             const unsigned until = next < tick_count ? ticks[next].frame : n;
+             const int32_t held = level * 16384 / 60;
+             while (f < until && timer > cycles[f]) {
+                 timer -= cycles[f];
+                 level_sum[f++] = held;
              }
+             if (f == n)
+                 break;
+ 
+             unsigned left = cycles[f];
+             int32_t acc = 0;
+             if (f == until) {
+                 if (on) {
+                     fixed_run(i, ticks[next].at, &timer, &level, &acc);
+                     fixed_tick(i, (seq_step + next) & 7);
+                     level = fixed_level(i);
+                     on = c->enabled;
+                     if (!on)
+                         timer = UINT_MAX;
+                 }
+                 left -= ticks[next].at;
+                 ++next;
+             }
+             if (on)
+                 fixed_run(i, left, &timer, &level, &acc);
+             level_sum[f] = (acc * fixed_recip[cycles[f]]) >> 8;
+             ++f;
+         }
+         fixed[i].timer = timer;
+ 
+ #if ENABLE_HIPASS
+         /* Keeps 255/256 of the charge a frame, against 0.996 in hipass_block */
+         int32_t cap = fixed[i].capacitor;
+         for (unsigned f = 0; f < n; ++f) {
+             int32_t out = level_sum[f] - (cap >> 8);
+             cap += ((level_sum[f] << 8) - cap) >> 8;
+             mono[i][f] = (int16_t) MAX(-32768, MIN(32767, out));
+         }
+         fixed[i].capacitor = cap;
+ #else
+         for (unsigned f = 0; f < n; ++f)
+             mono[i][f] = (int16_t) level_sum[f];
+ #endif
+ 
+         if (c->muted)
+             continue;
+         blocks[i] = mono[i];
+         gain[i][0] = (int16_t) (c->on_left * 8192 * master[0] / 7);
+         gain[i][1] = (int16_t) (c->on_right * 8192 * master[1] / 7);
+     }
+     seq_step = (seq_step + tick_count) & 7;
+ 
+     fixed_mix(samples, blocks, gain, n);
+ }
+ 
+ /* Skipped output: the channels are only run through their length,
+  * envelope and sweep counters, or the frame sequencer in fixed point, so
+  * NR52's status bits and the state the channels pick up from afterwards
+  * come out as if every frame had been synthesised. Waveforms don't move.
+  */
+ static void fixed_skip(const unsigned n)
+ {
+     uint64_t frac = cycle_frac + (uint64_t) (uint32_t) (65536.0 / samples_per_cycle) * n;
+     uint64_t cycles = frac >> 16;
+     cycle_frac = frac & 0xFFFF;
+ 
+     while (cycles >= seq_timer) {
+         cycles -= seq_timer;
+         seq_timer = SEQ_PERIOD;
+         for (uint_fast8_t i = 0; i < 4; ++i) {
+             if (chans[i].powered && chans[i].enabled)
+                 fixed_tick(i, seq_step);
+         }
+         seq_step = (seq_step + 1) & 7;
+     }
+     seq_timer -= cycles;
+ }
+ 
+ static void skip_render(const unsigned n)
+ {
+     if (chans[3].freq >= 14)
+         chans[3].enabled = 0;
+ 
+     if (APU_FIXED_POINT && synthesis == AUDIO_SYNTH_CLASSIC) {
+         fixed_skip(n);
+         return;
+     }
+ 
+     for (uint_fast8_t i = 0; i < 4; ++i) {
+         struct chan *c = chans + i;
+         for (unsigned t = 0, k; t < n && c->powered && c->enabled; t += k) {
+             k = until_event(i, n - t);
+             run_events(i, k);
          }
+         blep_chan[i].edge = MAX(blep_chan[i].edge - n, 0.0f);
      }
  }
  
- /* SDL2 style audio callback function */
+ void audio_set_synthesis(const int mode)
+ {
+     synthesis = mode;
+ }
+ 
+ static int64_t now_ns(void)
+ {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ }
+ 
+ /* SDL2 style audio callback function. Only drains the ring, whatever isn't
+  * there yet is played as silence.
+  */
  void audio_callback(void *userdata, uint8_t *restrict stream, int len)
  {
      float *samples = (float *) stream;
+     unsigned frames = len / (2 * sizeof(float));
  
      /* Appease unused variable warning. */
      (void) userdata;
  
-     memset(stream, 0, len);
+     unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+     unsigned head = atomic_load_explicit(&ring_head, memory_order_acquire);
+     unsigned got = MIN(head - tail, frames);
  
-     update_square(samples, 0);
-     update_square(samples, 1);
-     update_wave(samples);
-     update_noise(samples);
+     for (unsigned i = 0; i < got; ++i) {
+         unsigned at = ((tail + i) & (AUDIO_RING_FRAMES - 1)) * 2;
+         samples[i * 2 + 0] = ring[at + 0];
+         samples[i * 2 + 1] = ring[at + 1];
+     }
+     memset(samples + got * 2, 0, (frames - got) * 2 * sizeof(float));
+ 
+     atomic_store_explicit(&ring_tail, tail + got, memory_order_release);
+     if (got < frames && atomic_load_explicit(&streaming, memory_order_relaxed))
+         atomic_fetch_add(&underruns, 1);
+ 
+     /* Callbacks should come one buffer apart */
+     int64_t now = now_ns();
+     int64_t last = atomic_load(&callback_ns);
+     if (last) {
+         double error = fabs((now - last) / 1e6 - frames * 1000.0 / device_rate);
+         double smoothed = atomic_load(&jitter_ms);
+         atomic_store(&jitter_ms, smoothed + (error - smoothed) * JITTER_SMOOTHING);
+         if (error > atomic_load(&jitter_max_ms))
+             atomic_store(&jitter_max_ms, error);
+     }
+     atomic_store(&callback_frames, frames);
+     atomic_store(&callback_ns, now);
+ }
+ 
+ unsigned audio_buffered(void)
+ {
+     return atomic_load_explicit(&ring_head, memory_order_relaxed) -
+            atomic_load_explicit(&ring_tail, memory_order_relaxed);
+ }
+ 
+ /* Every channel into its own mono block, then the block passes: high-pass
+  * and panning with master volume. A silenced channel is still filtered, so
+  * its capacitor discharges as it would on the real thing.
+  */
+ static void classic_render(float *restrict samples, const unsigned n)
+ {
+     static float mono[4][SYNTH_BLOCK];
+ 
+     for (uint_fast8_t i = 0; i < 4; ++i) {
+         struct chan *c = chans + i;
+         bool rendered = i < 2   ? update_square(mono[i], n, i)
+                         : i == 2 ? update_wave(mono[i], n)
+                                  : update_noise(mono[i], n);
+         if (!rendered)
+             continue;
+ 
+ #if ENABLE_HIPASS
+         hipass_block(mono[i], n, &c->capacitor);
+ #endif
+         if (!c->muted && (c->on_left || c->on_right))
+             mix_block(samples, mono[i], n, 0.25f * c->on_left * vol_l, 0.25f * c->on_right * vol_r);
+     }
+ }
+ 
+ /* Build the kernel for the device's rate, cut off a little below whichever
+  * Nyquist is lower, at every tabulated offset and one past the last, so
+  * each phase has a neighbour to interpolate towards.
+  */
+ static void resample_init(void)
+ {
+     windowed_sinc(resample_kernel[0], RESAMPLE_PHASES, RESAMPLE_TAPS,
+                   0.9 * MIN(1.0, device_rate / AUDIO_SAMPLE_RATE), RESAMPLE_TAPS / 2 - 1);
+ 
+     resampler.step = AUDIO_SAMPLE_RATE / device_rate;
+     resampler.pos = 0.0;
+     resampler.have = RESAMPLE_TAPS - 1; /* Start on silence */
+     memset(resampler.hist, 0, sizeof(resampler.hist));
+ }
+ 
+ /* Resample "n" synthesised frames into "out", returning how many device
+  * frames they made. Window positions and phases are worked out first, then
+  * the kernel runs over them; what the next block's windows still need is
+  * kept.
+  */
+ static unsigned resample(float *restrict out, const float *restrict in, const unsigned n)
+ {
+     static uint32_t at[SYNTH_BLOCK * RESAMPLE_MAX_RATIO + 1];
+     static uint16_t phase[SYNTH_BLOCK * RESAMPLE_MAX_RATIO + 1];
+     static float frac[SYNTH_BLOCK * RESAMPLE_MAX_RATIO + 1];
+ 
+     for (unsigned i = 0; i < n; ++i) {
+         resampler.hist[0][resampler.have + i] = in[i * 2 + 0];
+         resampler.hist[1][resampler.have + i] = in[i * 2 + 1];
+     }
+     resampler.have += n;
+ 
+     unsigned count = 0;
+     double pos = resampler.pos;
+     while ((unsigned) pos + RESAMPLE_TAPS <= resampler.have) {
+         double offset = (pos - floor(pos)) * RESAMPLE_PHASES;
+         at[count] = (uint32_t) pos;
+         phase[count] = (uint16_t) offset;
+         frac[count] = (float) (offset - phase[count]);
+         ++count;
+         pos += resampler.step;
+     }
+     resample_block(out, count, at, phase, frac);
+ 
+     unsigned used = (unsigned) pos;
+     resampler.have -= used;
+     resampler.pos = pos - used;
+     for (int ch = 0; ch < 2; ++ch)
+         memmove(resampler.hist[ch], resampler.hist[ch] + used, resampler.have * sizeof(float));
+     return count;
+ }
+ 
+ /* Queue "n" device frames for the callback. Frames that don't fit are
+  * dropped.
+  */
+ static void ring_put(const float *restrict frames, const unsigned n)
+ {
+     unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+     unsigned tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+     unsigned space = AUDIO_RING_FRAMES - (head - tail);
+     unsigned put = MIN(n, space);
+ 
+     for (unsigned i = 0; i < put; ++i) {
+         unsigned at = ((head + i) & (AUDIO_RING_FRAMES - 1)) * 2;
+         ring[at + 0] = frames[i * 2 + 0];
+         ring[at + 1] = frames[i * 2 + 1];
+     }
+     atomic_store_explicit(&ring_head, head + put, memory_order_release);
+     atomic_store_explicit(&streaming, true, memory_order_relaxed);
+     if (put < n)
+         atomic_fetch_add(&overruns, 1);
+ }
+ 
+ /* Synthesise up to frame "target", at the synthesis rate, into the ring or
+  * the sink, by way of the resampler if the device runs at another rate.
+  */
+ static void synth_to(const uint64_t target)
+ {
+     static float block[SYNTH_BLOCK * 2];
+     static float resampled[(SYNTH_BLOCK * RESAMPLE_MAX_RATIO + 1) * 2];
+ 
+     while (synth_pos < target) {
+         unsigned n = MIN(target - synth_pos, SYNTH_BLOCK);
+ 
+         /* Decimated, the output goes in video frames, one in every
+          * "decimation" heard at its own pitch and the rest skipped.
+          */
+         if (decimation != 1) {
+             uint64_t frame = synth_pos / AUDIO_SAMPLES;
+             n = MIN(n, (frame + 1) * AUDIO_SAMPLES - synth_pos);
+             if (decimation == 0 || frame % decimation) {
+                 skip_render(n);
+                 synth_pos += n;
+                 continue;
+             }
+         }
+ 
+         memset(block, 0, n * 2 * sizeof(float));
+         if (synthesis == AUDIO_SYNTH_BLEP) {
+             blep_render(block, n);
+         } else if (APU_FIXED_POINT) {
+             fixed_render(block, n);
+         } else {
+             classic_render(block, n);
+         }
+ 
+         const float *out = block;
+         unsigned frames = n;
+         if (resampler.on) {
+             frames = resample(resampled, block, n);
+             out = resampled;
+         }
+         if (sink)
+             sink(out, frames);
+         else
+             ring_put(out, frames);
+ 
+         synth_pos += n;
+     }
+ }
+ 
+ /* The output frame emulated cycle "cycle" falls on. */
+ static uint64_t frame_at(const uint64_t cycle)
+ {
+     if (cycle <= synth_cycle)
+         return (uint64_t) synth_time;
+     return (uint64_t) (synth_time + (cycle - synth_cycle) * samples_per_cycle);
+ }
+ 
+ /* Audio queued ahead of the speaker: the ring, plus what is left of the
+  * last buffer the callback handed over, assuming the device has been
+  * playing it since. The ring alone jumps by a whole buffer at every
+  * callback. In frames at the synthesis rate, as rate control counts.
+  */
+ static double queued_frames(void)
+ {
+     double played = (now_ns() - atomic_load(&callback_ns)) * device_rate / 1e9;
+     double left = atomic_load(&callback_frames) - played;
+     return (audio_buffered() + MAX(left, 0.0)) * AUDIO_SAMPLE_RATE / device_rate;
+ }
+ 
+ /* Pad the ring with silence up to "frames" queued, as queued_frames()
+  * counts them.
+  */
+ static void prime_ring(const double frames)
+ {
+     unsigned head = atomic_load(&ring_head);
+     double queued = queued_frames();
+     unsigned add = frames > queued ? (unsigned) ((frames - queued) * device_rate / AUDIO_SAMPLE_RATE) : 0;
+     for (unsigned i = 0; i < add; ++i) {
+         unsigned at = ((head + i) & (AUDIO_RING_FRAMES - 1)) * 2;
+         ring[at + 0] = ring[at + 1] = 0.0f;
+     }
+     atomic_store_explicit(&ring_head, head + add, memory_order_release);
+ }
+ 
+ static void set_target(const double frames)
+ {
+     drc.target = MIN(MAX(frames, drc.floor), AUDIO_RING_FRAMES * 0.75 * AUDIO_SAMPLE_RATE / device_rate);
+     atomic_store(&drc_target_ms, drc.target * 1000.0 / AUDIO_SAMPLE_RATE);
+ }
+ 
+ /* Raise the margin at once on an underrun, padding the ring with silence
+  * since the device has glitched already, and ease it back down while
+  * nothing goes wrong, leaving rate control to drain the difference.
+  */
+ static void adapt_latency(void)
+ {
+     unsigned seen = atomic_load(&underruns);
+     if (seen != adapt.underruns) {
+         adapt.underruns = seen;
+         adapt.margin = MIN(adapt.margin * LATENCY_GROW, LATENCY_MAX_MS * AUDIO_SAMPLE_RATE / 1000.0);
+         adapt.stable = 0;
+         set_target(drc.chunk + adapt.margin);
+         prime_ring(drc.target);
+         drc.fill = drc.target;
+     } else if (++adapt.stable >= LATENCY_STABLE_FRAMES && adapt.margin > adapt.min) {
+         adapt.margin = MAX(adapt.margin * LATENCY_SHRINK, adapt.min);
+         adapt.stable = 0;
+         set_target(drc.chunk + adapt.margin);
+     }
+ }
+ 
+ /* Nudge the ratio of output frames to emulated cycles so the queue stays
+  * around its target: proportional to how far off the smoothed fill is, plus
+  * an integral that takes up a steady difference between the device's clock
+  * and ours. The integral holds while the ratio is at its limit, so it
+  * doesn't wind up on an error the ratio can't correct any faster.
+  */
+ void audio_rate_update(void)
+ {
+     if (!drc.on)
+         return;
+     if (adapt.on)
+         adapt_latency();
+ 
+     drc.fill += (queued_frames() - drc.fill) * DRC_SMOOTHING;
+     double error = (drc.fill - drc.target) / AUDIO_SAMPLES;
+ 
+     double integral = drc.integral + error * DRC_I;
+     integral = MAX(-DRC_MAX_ADJUST, MIN(DRC_MAX_ADJUST, integral));
+ 
+     double adjust = -(error * DRC_P + integral);
+     if (fabs(adjust) <= DRC_MAX_ADJUST)
+         drc.integral = integral;
+     adjust = MAX(-DRC_MAX_ADJUST, MIN(DRC_MAX_ADJUST, adjust));
+     samples_per_cycle = SAMPLES_PER_CYCLE * (1.0 + adjust);
+ 
+     atomic_store(&drc_latency_ms, drc.fill * 1000.0 / AUDIO_SAMPLE_RATE);
+     atomic_store(&drc_ratio, 1.0 + adjust);
+     atomic_store(&drc_drift_ppm, -drc.integral * 1e6);
+ }
+ 
+ /* Rate control towards "target" frames queued, with audio_run() adding up
+  * to "chunk" at a time, and never aiming below "floor".
+  */
+ static void start_rate_control(const bool on, const double target, const double chunk,
+                                const double floor)
+ {
+     drc.on = on;
+     drc.chunk = chunk;
+     drc.floor = floor;
+     set_target(target);
+     drc.fill = drc.target;
+     drc.integral = 0.0;
+     samples_per_cycle = SAMPLES_PER_CYCLE;
+     adapt.on = false;
+     if (!on)
+         return;
+ 
+     /* Start at the target with silence, rather than climbing up to it a
+      * fraction of a percent at a time. The first chunk of audio comes on
+      * top before anything is measured.
+      */
+     prime_ring(drc.target - chunk);
+ }
+ 
+ void audio_set_rate_control(const bool on, const double target_ms, const unsigned device_frames)
+ {
+     start_rate_control(on, target_ms * AUDIO_SAMPLE_RATE / 1000.0, AUDIO_SAMPLES,
+                        AUDIO_SAMPLES + device_frames * AUDIO_SAMPLE_RATE / device_rate +
+                            DRC_SLACK_MS * AUDIO_SAMPLE_RATE / 1000.0);
+ }
+ 
+ void audio_set_adaptive_latency(const double min_ms, const unsigned device_frames,
+                                 const unsigned slice_frames)
+ {
+     double device = device_frames * AUDIO_SAMPLE_RATE / device_rate;
+     double margin = MAX(min_ms * AUDIO_SAMPLE_RATE / 1000.0, device);
+     start_rate_control(true, slice_frames + margin, slice_frames, slice_frames + device);
+ 
+     adapt.on = true;
+     adapt.min = margin;
+     adapt.margin = margin;
+     adapt.underruns = atomic_load(&underruns);
+     adapt.stable = 0;
+ }
+ 
+ bool audio_set_device_rate(const double rate)
+ {
+     if (rate * RESAMPLE_MAX_RATIO < AUDIO_SAMPLE_RATE || rate > AUDIO_SAMPLE_RATE * RESAMPLE_MAX_RATIO) {
+         device_rate = AUDIO_SAMPLE_RATE;
+         resampler.on = false;
+         return false;
+     }
+     device_rate = rate;
+     resampler.on = rate != AUDIO_SAMPLE_RATE;
+     if (resampler.on)
+         resample_init();
+     return true;
+ }
+ 
+ void audio_set_decimation(const unsigned every)
+ {
+     decimation = every;
+ }
+ 
+ void audio_set_sink(audio_sink to)
+ {
+     sink = to;
+ }
+
+ void audio_get_stats(struct audio_stats *stats)
+ {
+     stats->latency_ms = atomic_load(&drc_latency_ms);
+     stats->target_ms = atomic_load(&drc_target_ms);
+     stats->ratio = atomic_load(&drc_ratio);
+     stats->drift_ppm = atomic_load(&drc_drift_ppm);
+     stats->underruns = atomic_load(&underruns);
+     stats->overruns = atomic_load(&overruns);
+     stats->jitter_ms = atomic_load(&jitter_ms);
+     stats->jitter_max_ms = atomic_load(&jitter_max_ms);
  }
  
  static void chan_trigger(uint_fast8_t i)
@@ -388,6 +1731,11 @@
  
      c->len.inc = (256.0f / (float) (len_max - c->len.load)) / AUDIO_SAMPLE_RATE;
      c->len.counter = 0.0f;
+ 
+     fixed[i].timer = chan_period(i);
+     fixed[i].len_left = len_max - c->len.load;
+     fixed[i].env_timer = c->env.step;
+     fixed[i].sweep_timer = c->sweep.rate;
  }
  
  /* Read audio register.
@@ -395,8 +1743,11 @@
   *              This is not checked in this function.
   * \return      Byte at address.
   */
- uint8_t audio_read(const uint16_t addr)
+ uint8_t audio_read(const uint16_t addr, const uint64_t cycle)
  {
+     /* Bring the channels up to now, so status and length reads are exact. */
+     audio_run(cycle);
+ 
      static uint8_t ortab[] = {0x80, 0x3f, 0x00, 0xff, 0xbf, 0xff, 0x3f, 0x00,
                                0xff, 0xbf, 0x7f, 0xff, 0x9f, 0xff, 0xbf, 0xff,
                                0xff, 0x00, 0x00, 0xbf, 0x00, 0x00, 0x70};
@@ -407,12 +1758,12 @@
      return audio_mem[addr - AUDIO_ADDR_COMPENSATION] | ortab[addr - 0xFF10];
  }
  
- /* Write audio register.
+ /* Write audio register, taking effect straight away.
   * \param addr  Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
   *              This is not checked in this function.
   * \param val   Byte to write at address.
   */
- void audio_write(const uint16_t addr, const uint8_t val)
+ static void apply_write(const uint16_t addr, const uint8_t val)
  {
      /* Find sound channel corresponding to register address. */
      uint_fast8_t i = (addr - 0xFF10) / 5;
@@ -504,12 +1855,56 @@
      }
  }
  
+ void audio_write(const uint16_t addr, const uint8_t val, const uint64_t cycle)
+ {
+     if (write_count == WRITE_LOG_SIZE)
+         audio_run(cycle);
+ 
+     write_log[write_count].cycle = cycle;
+     write_log[write_count].addr = addr;
+     write_log[write_count].val = val;
+     write_count++;
+ }
+ 
+ void audio_run(const uint64_t cycle)
+ {
+     for (unsigned i = 0; i < write_count; ++i) {
+         synth_to(frame_at(write_log[i].cycle));
+         apply_write(write_log[i].addr, write_log[i].val);
+     }
+     write_count = 0;
+ 
+     if (cycle > synth_cycle) {
+         synth_time += (cycle - synth_cycle) * samples_per_cycle;
+         synth_cycle = cycle;
+     }
+     synth_to((uint64_t) synth_time);
+ }
+ 
  void audio_init(void)
  {
      /* Initialize channels and samples */
      memset(chans, 0, sizeof(chans));
      chans[0].val = chans[1].val = -1;
  
+     /* Emulated time starts over, with nothing synthesised */
+     write_count = 0;
+     synth_pos = 0;
+     synth_cycle = 0;
+     synth_time = 0.0;
+     simd_init();
+     blep_init();
+     fixed_init();
+     if (resampler.on)
+         resample_init();
+     atomic_store(&ring_head, 0);
+     atomic_store(&ring_tail, 0);
+     atomic_store(&streaming, false);
+     atomic_store(&underruns, 0);
+     atomic_store(&overruns, 0);
+     atomic_store(&jitter_ms, 0.0);
+     atomic_store(&jitter_max_ms, 0.0);
+ 
      /* Initialize IO registers */
      {
          const uint8_t regs_init[] = {0x80, 0xBF, 0xF3, 0xFF, 0x3F, 0xFF,
@@ -518,7 +1913,7 @@
                                       0x00, 0x3F, 0x77, 0xF3, 0xF1};
  
          for (uint_fast8_t i = 0; i < sizeof(regs_init); ++i)
-             audio_write(0xFF10 + i, regs_init[i]);
+             apply_write(0xFF10 + i, regs_init[i]);
      }
  
      /* Initialize Wave Pattern RAM */
@@ -528,6 +1923,270 @@
                                       0xac, 0xdd, 0xda, 0x48};
  
          for (uint_fast8_t i = 0; i < sizeof(wave_init); ++i)
-             audio_write(0xFF30 + i, wave_init[i]);
+             apply_write(0xFF30 + i, wave_init[i]);
+     }
+ }
+ 
+ /* Self-test. It drives the APU itself, so it runs instead of emulation,
+  * and audio_init() has to be called again afterwards.
+  */
+ 
+ /* xorshift32, so every run checks the same inputs */
+ static uint32_t test_rand(uint32_t *state)
+ {
+     uint32_t x = *state;
+     x ^= x << 13;
+     x ^= x >> 17;
+     x ^= x << 5;
+     return *state = x;
+ }
+ 
+ /* Uniform in -1..1 */
+ static float test_float(uint32_t *state)
+ {
+     return (float) (test_rand(state) / (double) UINT32_MAX * 2.0 - 1.0);
+ }
+ 
+ static bool close_to(const float *want, const float *got, const unsigned n, const float tolerance)
+ {
+     for (unsigned i = 0; i < n; ++i)
+         if (fabsf(want[i] - got[i]) > tolerance)
+             return false;
+     return true;
+ }
+ 
+ struct kernel_set {
+     const char *name;
+     void (*hipass)(float *restrict mono, const unsigned n, float *capacitor);
+     void (*mix)(float *restrict stereo, const float *restrict mono,
+                 const unsigned n, const float gain_l, const float gain_r);
+     void (*fixed_mix)(float *restrict stereo, const int16_t *const mono[4],
+                       const int16_t gain[4][2], const unsigned n);
+     void (*resample)(float *restrict stereo, const unsigned count, const uint32_t *at,
+                      const uint16_t *phase, const float *frac);
+ };
+ 
+ /* Every kernel of "set" against the scalar one, on random blocks of every
+  * size up to SYNTH_BLOCK. Float kernels may round differently, the fixed
+  * point mixer has to match exactly. The resampler's kernel table has to
+  * have been built.
+  */
+ static bool check_kernels(const struct kernel_set *set)
+ {
+     static float mono[2][SYNTH_BLOCK];
+     static float want[SYNTH_BLOCK * 2], got[SYNTH_BLOCK * 2];
+     static int16_t fixed[4][SYNTH_BLOCK];
+     static uint32_t at[SYNTH_BLOCK];
+     static uint16_t phase[SYNTH_BLOCK];
+     static float frac[SYNTH_BLOCK];
+     const int16_t *const blocks[4] = {fixed[0], fixed[1], fixed[2], fixed[3]};
+     uint32_t seed = 0x2545F491;
+ 
+     for (int round = 0; round < 200; ++round) {
+         const unsigned n = 1 + test_rand(&seed) % SYNTH_BLOCK;
+ 
+         float cap[2];
+         cap[0] = cap[1] = test_float(&seed);
+         for (unsigned i = 0; i < n; ++i)
+             mono[0][i] = mono[1][i] = test_float(&seed);
+         hipass_block_scalar(mono[0], n, &cap[0]);
+         set->hipass(mono[1], n, &cap[1]);
+         if (!close_to(mono[0], mono[1], n, 1e-5f) || fabsf(cap[0] - cap[1]) > 1e-5f) {
+             printf("hipass_block_%s: %u frames differ from scalar\n", set->name, n);
+             return false;
+         }
+ 
+         /* Panned on top of what the block already holds */
+         const float gain_l = test_float(&seed), gain_r = test_float(&seed);
+         for (unsigned i = 0; i < n * 2; ++i)
+             want[i] = got[i] = test_float(&seed);
+         mix_block_scalar(want, mono[0], n, gain_l, gain_r);
+         set->mix(got, mono[0], n, gain_l, gain_r);
+         if (!close_to(want, got, n * 2, 1e-6f)) {
+             printf("mix_block_%s: %u frames differ from scalar\n", set->name, n);
+             return false;
+         }
+ 
+         /* Q14 levels and Q15 gains, as fixed_render() makes them */
+         int16_t gain[4][2];
+         for (int c = 0; c < 4; ++c) {
+             gain[c][0] = (int16_t) (test_rand(&seed) % 32768);
+             gain[c][1] = (int16_t) (test_rand(&seed) % 32768);
+             for (unsigned i = 0; i < n; ++i)
+                 fixed[c][i] = (int16_t) (test_rand(&seed) % 32769) - 16384;
+         }
+         fixed_mix_scalar(want, blocks, gain, n);
+         set->fixed_mix(got, blocks, gain, n);
+         if (memcmp(want, got, n * 2 * sizeof(float)) != 0) {
+             printf("fixed_mix_%s: %u frames differ from scalar\n", set->name, n);
+             return false;
+         }
+ 
+         /* Windows anywhere in the history, at any offset */
+         for (unsigned j = 0; j < RESAMPLE_TAPS + SYNTH_BLOCK; ++j) {
+             resampler.hist[0][j] = test_float(&seed);
+             resampler.hist[1][j] = test_float(&seed);
+         }
+         for (unsigned i = 0; i < n; ++i) {
+             at[i] = test_rand(&seed) % (SYNTH_BLOCK + 1);
+             phase[i] = test_rand(&seed) % RESAMPLE_PHASES;
+             frac[i] = (test_rand(&seed) & 0xFFFF) / 65536.0f;
+         }
+         resample_block_scalar(want, n, at, phase, frac);
+         set->resample(got, n, at, phase, frac);
+         if (!close_to(want, got, n * 2, 1e-5f)) {
+             printf("resample_block_%s: %u frames differ from scalar\n", set->name, n);
+             return false;
+         }
      }
- }
\ No newline at end of file
+     return true;
+ }
+ 
+ /* Resample a 1 kHz sine to "rate" and fit a 1 kHz sine to what comes out,
+  * skipping the start where the history was silent. What the fit leaves is
+  * noise, aliasing and any error in pitch. In dB.
+  */
+ static double resample_snr(const double rate)
+ {
+     static float in[SYNTH_BLOCK * 2];
+     static float out[(SYNTH_BLOCK * RESAMPLE_MAX_RATIO + 1) * 2];
+     static float heard[48 * (SYNTH_BLOCK * RESAMPLE_MAX_RATIO + 1)];
+     const double w_in = 2 * M_PI * 1000.0 / AUDIO_SAMPLE_RATE;
+     const double w_out = 2 * M_PI * 1000.0 / rate;
+     unsigned count = 0;
+ 
+     audio_set_device_rate(rate);
+     for (unsigned block = 0; block < 48; ++block) {
+         for (unsigned i = 0; i < SYNTH_BLOCK; ++i)
+             in[i * 2 + 0] = in[i * 2 + 1] = (float) (0.5 * sin(w_in * (block * SYNTH_BLOCK + i)));
+         unsigned made = resample(out, in, SYNTH_BLOCK);
+         for (unsigned i = 0; i < made; ++i)
+             heard[count++] = out[i * 2];
+     }
+ 
+     /* Least squares for a * sin + b * cos */
+     double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0;
+     const unsigned skip = RESAMPLE_TAPS * RESAMPLE_MAX_RATIO;
+     for (unsigned t = skip; t < count; ++t) {
+         double s = sin(w_out * t), c = cos(w_out * t);
+         ss += s * s;
+         cc += c * c;
+         sc += s * c;
+         ys += heard[t] * s;
+         yc += heard[t] * c;
+     }
+     double det = ss * cc - sc * sc;
+     double a = (ys * cc - yc * sc) / det;
+     double b = (yc * ss - ys * sc) / det;
+ 
+     double signal = 0, noise = 0;
+     for (unsigned t = skip; t < count; ++t) {
+         double fit = a * sin(w_out * t) + b * cos(w_out * t);
+         signal += fit * fit;
+         noise += (heard[t] - fit) * (heard[t] - fit);
+     }
+     audio_set_device_rate(AUDIO_SAMPLE_RATE);
+     return 10.0 * log10(signal / noise);
+ }
+ 
+ static void discard(const float *samples, unsigned frames)
+ {
+     (void) samples;
+     (void) frames;
+ }
+ 
+ /* The decimation check's writes, a little into video frame "frame": all
+  * four channels started with their length counters on, channel 1 again
+  * with a sweep that overflows, channel 2 again with a shorter length and
+  * channel 4 again without one, then its DAC turned off.
+  */
+ #define TEST_FRAMES 80
+ static const struct {
+     uint8_t frame;
+     uint16_t addr;
+     uint8_t val;
+ } test_writes[] = {
+     {0, 0xFF26, 0x80}, {0, 0xFF24, 0x77}, {0, 0xFF25, 0xFF},
+     {0, 0xFF10, 0x00}, {0, 0xFF11, 0xA0}, {0, 0xFF12, 0xF3}, {0, 0xFF13, 0x00}, {0, 0xFF14, 0xC6},
+     {0, 0xFF16, 0x40}, {0, 0xFF17, 0xA1}, {0, 0xFF18, 0x80}, {0, 0xFF19, 0xC5},
+     {0, 0xFF1A, 0x80}, {0, 0xFF1B, 0xC0}, {0, 0xFF1C, 0x20}, {0, 0xFF1D, 0x40}, {0, 0xFF1E, 0xC4},
+     {0, 0xFF20, 0x30}, {0, 0xFF21, 0xF1}, {0, 0xFF22, 0x55}, {0, 0xFF23, 0xC0},
+     {20, 0xFF10, 0x11}, {20, 0xFF12, 0xF0}, {20, 0xFF13, 0x00}, {20, 0xFF14, 0x85},
+     {40, 0xFF16, 0x70}, {40, 0xFF19, 0xC5},
+     {45, 0xFF21, 0xF0}, {45, 0xFF23, 0x80}, {60, 0xFF21, 0x00},
+ };
+ 
+ /* Play the writes above and read NR52 four times a video frame */
+ static void nr52_timeline(const int mode, const unsigned every, uint8_t *timeline)
+ {
+     const double frame_cycles = SCREEN_REFRESH_CYCLES;
+     unsigned next = 0;
+ 
+     audio_init();
+     audio_set_synthesis(mode);
+     audio_set_decimation(every);
+     for (unsigned frame = 0; frame < TEST_FRAMES; ++frame) {
+         const uint64_t start = (uint64_t) (frame * frame_cycles);
+         for (; next < sizeof(test_writes) / sizeof(test_writes[0]) && test_writes[next].frame == frame; ++next)
+             audio_write(test_writes[next].addr, test_writes[next].val, start + 1000 + next * 4);
+         for (int q = 0; q < 4; ++q)
+             timeline[frame * 4 + q] = audio_read(0xFF26, start + (uint64_t) (frame_cycles * (q + 1) / 4));
+     }
+ }
+ 
+ bool audio_selftest(void)
+ {
+     bool ok = true;
+ 
+     audio_init();
+     audio_set_sink(discard);
+ 
+     /* The kernel table the block checks run against, at an arbitrary rate */
+     audio_set_device_rate(44100.0);
+ #if APU_SIMD_X86
+     const struct kernel_set sets[] = {
+         {"sse2", hipass_block_sse2, mix_block_sse2, fixed_mix_sse2, resample_block_sse2},
+         {"avx2", hipass_block_avx2, mix_block_avx2, fixed_mix_avx2, resample_block_avx2},
+     };
+     __builtin_cpu_init();
+     const bool have[] = {__builtin_cpu_supports("sse2"), __builtin_cpu_supports("avx2")};
+     for (int i = 0; i < 2; ++i) {
+         if (!have[i]) {
+             printf("APU %s: not supported here, skipped\n", sets[i].name);
+             continue;
+         }
+         bool passed = check_kernels(&sets[i]);
+         printf("APU %s: %s\n", sets[i].name, passed ? "matches scalar" : "FAILED");
+         ok = ok && passed;
+     }
+ #endif
+ 
+     const double rates[] = {22050.0, 44100.0, 96000.0};
+     for (int i = 0; i < 3; ++i) {
+         double snr = resample_snr(rates[i]);
+         bool passed = snr >= 80.0;
+         printf("APU resampling a sine to %.0f Hz: %.1f dB SNR%s\n", rates[i], snr, passed ? "" : ", FAILED");
+         ok = ok && passed;
+     }
+ 
+     /* Decimation leaves NR52 as a full run has it, in every synthesis mode */
+     const int modes[] = {AUDIO_SYNTH_CLASSIC, AUDIO_SYNTH_BLEP};
+     const char *mode_names[] = {APU_FIXED_POINT ? "fixed point" : "classic", "blep"};
+     const unsigned everys[] = {0, 3};
+     for (int m = 0; m < 2; ++m) {
+         static uint8_t full[TEST_FRAMES * 4], decimated[TEST_FRAMES * 4];
+         bool passed = true;
+         nr52_timeline(modes[m], 1, full);
+         for (int e = 0; e < 2; ++e) {
+             nr52_timeline(modes[m], everys[e], decimated);
+             passed = passed && memcmp(full, decimated, sizeof(full)) == 0;
+         }
+         printf("APU NR52 under decimation, %s: %s\n", mode_names[m], passed ? "matches a full run" : "FAILED");
+         ok = ok && passed;
+     }
+ 
+     audio_set_decimation(1);
+     audio_set_synthesis(AUDIO_SYNTH_CLASSIC);
+     audio_set_sink(NULL);
+     return ok;
+ }
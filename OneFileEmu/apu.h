@@ -5,8 +5,12 @@
 
  #pragma once
 
+ #include <stdbool.h>
  #include <stdint.h>
  
+ /* The rate synthesis runs at. A device at another rate is resampled to,
+  * see audio_set_device_rate().
+  */
  #define AUDIO_SAMPLE_RATE 48000.0
  
  #define DMG_CLOCK_FREQ 4194304.0
@@ -17,21 +21,141 @@
  
  #define AUDIO_SAMPLES ((unsigned) (AUDIO_SAMPLE_RATE / VERTICAL_SYNC))
  
+ /* Stereo frames the ring between synthesis and the callback holds, at the
+  * device's rate, a power of two.
+  */
+ #define AUDIO_RING_FRAMES 8192
+ 
+ struct audio_stats {
+     double latency_ms;     /* Smoothed audio queued ahead of the device */
+     double target_ms;      /* What rate control aims to keep queued */
+     double ratio;          /* Output frames per emulated frame, 1 is nominal */
+     double drift_ppm;      /* How much faster than nominal the device plays */
+     unsigned underruns;    /* Callbacks that got less than they asked for */
+     unsigned overruns;     /* Synthesis blocks dropped, all or in part */
+     double jitter_ms;      /* Smoothed error of the callback period */
+     double jitter_max_ms;  /* Worst error of the callback period */
+ };
+ 
+ /* Built with APU_FIXED_POINT set, the classic path runs in integers off the
+  * channel timers and 512 Hz frame sequencer, and mixes in 16 bits.
+  */
+ enum audio_synthesis {
+     AUDIO_SYNTH_CLASSIC, /* Every channel sampled frame by frame */
+     AUDIO_SYNTH_BLEP     /* Band-limited steps, work goes with the edges */
+ };
+ 
  /**
-  * Fill allocated buffer "data" with "len" number of 32-bit floating point
-  * samples (native endian order) in stereo interleaved format.
+  * Fill allocated buffer "data" with "len" bytes of 32-bit floating point
+  * samples (native endian order) in stereo interleaved format, taken from
+  * what audio_run() has synthesised. Safe to call from the audio thread.
   */
  void audio_callback(void *ptr, uint8_t *data, int len);
  
  /**
-  * Read audio register at given address "addr".
+  * Read audio register at given address "addr" at emulated cycle "cycle".
+  */
+ uint8_t audio_read(const uint16_t addr, const uint64_t cycle);
+ 
+ /**
+  * Write "val" to audio register at given address "addr" at emulated cycle
+  * "cycle". The write is logged and takes effect when synthesis reaches it.
+  */
+ void audio_write(const uint16_t addr, const uint8_t val, const uint64_t cycle);
+ 
+ /**
+  * Synthesise everything up to emulated cycle "cycle" into the ring, applying
+  * the logged writes on the way. Cycles count from audio_init().
+  */
+ void audio_run(const uint64_t cycle);
+ 
+ /**
+  * Pick how the channels are synthesised, one of enum audio_synthesis.
+  */
+ void audio_set_synthesis(const int mode);
+ 
+ /**
+  * Name of the instruction set the classic mixer's block kernels were bound
+  * to at audio_init() ("scalar", "sse2" or "avx2").
+  */
+ const char *audio_simd_name(void);
+ 
+ /**
+  * Dynamic rate control. When on, the ratio of output frames to emulated
+  * cycles is nudged by up to half a percent so the audio queued ahead of the
+  * device stays around "target_ms", locking emulation, which the pacer holds
+  * to the display, to the audio device's clock. "device_frames" is the
+  * buffer the device got: the target is raised to at least a video frame of
+  * audio plus that buffer and a little slack, as anything less runs the ring
+  * dry between callbacks. Turning it on fills the ring to the target with
+  * silence. Call after audio_init() and audio_set_device_rate().
+  */
+ void audio_set_rate_control(const bool on, const double target_ms, const unsigned device_frames);
+ 
+ /**
+  * One rate control step, once per video frame right after audio_run(), so
+  * the queue is always measured at the same point of the frame. Does
+  * nothing while rate control is off.
+  */
+ void audio_rate_update(void);
+ 
+ /**
+  * Adaptive latency: rate control aiming for "slice_frames", the most audio
+  * one audio_run() adds when the caller runs it every few scanlines, plus a
+  * margin of "min_ms", or "device_frames" (the buffer the device actually
+  * got) if that is more. Each underrun raises the margin by half, padding
+  * the ring with silence; it eases back towards the minimum while the device
+  * keeps being fed. Call after the device is open.
+  */
+ void audio_set_adaptive_latency(const double min_ms, const unsigned device_frames,
+                                 const unsigned slice_frames);
+ 
+ /**
+  * The rate the device was opened at, which may not be the one asked for.
+  * Synthesis stays at AUDIO_SAMPLE_RATE and is resampled to "rate", for the
+  * ring and the sink alike. False, and no resampling, for rates more than
+  * four times away from AUDIO_SAMPLE_RATE. Call after audio_init(), before
+  * turning on rate control.
+  */
+ bool audio_set_device_rate(const double rate);
+ 
+ /**
+  * For runs faster than real time, where most of the sound would be thrown
+  * away: of every "every" video frames of output only the first is
+  * synthesised, at its proper pitch, and 0 synthesises none. The rest only
+  * runs the channels' length, envelope and sweep counters, so writes, NR52's
+  * status bits and the channels' state stay exact. 1, the default, hears
+  * everything.
+  */
+ void audio_set_decimation(const unsigned every);
+ 
+ /**
+  * Offline rendering: with a sink set, every block synthesis makes goes to
+  * it as it is made, "frames" stereo interleaved frames, on the thread that
+  * called audio_run(), and nothing reaches the ring or audio_callback().
+  * NULL goes back to the ring.
+  */
+ typedef void (*audio_sink)(const float *samples, unsigned frames);
+ void audio_set_sink(audio_sink to);
+ 
+ /**
+  * Latency and drift as rate control sees them, and the buffer's health
+  * since audio_init(). Safe from any thread.
+  */
+ void audio_get_stats(struct audio_stats *stats);
+ 
+ /**
+  * Stereo frames waiting in the ring, at the device's rate.
   */
- uint8_t audio_read(const uint16_t addr);
+ unsigned audio_buffered(void);
  
  /**
-  * Write "val" to audio register at given address "addr".
+  * Check the SIMD block kernels against the scalar ones on random input,
+  * the resampler's SNR on a sine at a few rates, and that decimation leaves
+  * NR52 as a full run has it, printing a line for each. True if all passed.
+  * It drives the APU, so run it instead of emulating.
   */
- void audio_write(const uint16_t addr, const uint8_t val);
+ bool audio_selftest(void);
  
  /**
   * Initialize audio driver.
@@ -0,0 +1,61 @@
+/**
+ * Emulation/presentation hand-off (see handoff.h).
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include "handoff.h"
+
+// Set in the shared slot index when it holds a frame the presentation has
+// not picked up yet.
+#define SLOT_NEW 4
+
+// Three frames: the emulation writes "back", the presentation reads
+// "front" and "shared" sits between them. Each side only ever swaps its own
+// slot with the shared one, so neither can touch the other's.
+static struct ppu_output slots[3];
+static int back = 0;
+static int front = 1;
+static atomic_int shared = 2;
+
+#define INPUT_RING_SIZE 64   // Power of two
+
+static struct input_event ring[INPUT_RING_SIZE];
+static atomic_uint ring_head;   // Next slot the presentation writes
+static atomic_uint ring_tail;   // Next slot the emulation reads
+
+void handoff_publish(const struct ppu_output *frame) {
+	memcpy(&slots[back], frame, sizeof(struct ppu_output));
+	back = atomic_exchange_explicit(&shared, back | SLOT_NEW, memory_order_acq_rel) & 3;
+}
+
+const struct ppu_output *handoff_latest(void) {
+	if (!(atomic_load_explicit(&shared, memory_order_relaxed) & SLOT_NEW)) {
+		return NULL;
+	}
+	front = atomic_exchange_explicit(&shared, front, memory_order_acq_rel) & 3;
+	return &slots[front];
+}
+
+bool input_push(struct input_event event) {
+	unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+	if (head - tail == INPUT_RING_SIZE) {
+		return false;
+	}
+	ring[head & (INPUT_RING_SIZE - 1)] = event;
+	atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+	return true;
+}
+
+bool input_pop(struct input_event *event) {
+	unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring_head, memory_order_acquire);
+	if (tail == head) {
+		return false;
+	}
+	*event = ring[tail & (INPUT_RING_SIZE - 1)];
+	atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+	return true;
+}
@@ -0,0 +1,46 @@
+/**
+ * Lock-free hand-off between the emulation thread and the presentation
+ * thread. Finished frames go one way through a triple buffer, so the
+ * emulation never waits on a present and the presentation always picks up
+ * the newest frame. Input goes the other way through a single producer,
+ * single consumer ring.
+ */
+
+#pragma once
+
+#include "qol.h"
+#include "ppu.h"
+
+enum input_kind {
+	INPUT_PRESS,     // Joypad button "key" went down
+	INPUT_RELEASE,   // Joypad button "key" went up
+	INPUT_RESET      // Jump back to 0x0000
+};
+
+struct input_event {
+	u8 kind;
+	u8 key;
+};
+
+/**
+ * Emulation side: copy "frame" into the back buffer and make it the newest.
+ */
+void handoff_publish(const struct ppu_output *frame);
+
+/**
+ * Presentation side: the newest frame if one was published since the last
+ * call, NULL otherwise. Stays valid until the next call.
+ */
+const struct ppu_output *handoff_latest(void);
+
+/**
+ * Presentation side: queue an input event. Returns false if the ring is
+ * full and the event was dropped.
+ */
+bool input_push(struct input_event event);
+
+/**
+ * Emulation side: take the oldest queued input event. Returns false when
+ * there is none.
+ */
+bool input_pop(struct input_event *event);
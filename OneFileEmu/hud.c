@@ -0,0 +1,181 @@
+/**
+ * Performance overlay (see hud.h).
+ */
+
+#include <stdio.h>
+
+#include "hud.h"
+
+#pragma region Font
+
+// 3x5 glyphs, one octal digit per row from the top, the highest bit of each
+// digit being the leftmost pixel. Covers space to underscore; lower case is
+// drawn as upper case.
+static const u16 font[64] = {
+	['0' - ' '] = 075557, ['1' - ' '] = 026227, ['2' - ' '] = 071747, ['3' - ' '] = 071717,
+	['4' - ' '] = 055711, ['5' - ' '] = 074717, ['6' - ' '] = 074757, ['7' - ' '] = 071111,
+	['8' - ' '] = 075757, ['9' - ' '] = 075717,
+	['A' - ' '] = 025755, ['B' - ' '] = 065656, ['C' - ' '] = 034443, ['D' - ' '] = 065556,
+	['E' - ' '] = 074647, ['F' - ' '] = 074644, ['G' - ' '] = 034553, ['H' - ' '] = 055755,
+	['I' - ' '] = 072227, ['J' - ' '] = 011152, ['K' - ' '] = 055655, ['L' - ' '] = 044447,
+	['M' - ' '] = 057755, ['N' - ' '] = 065555, ['O' - ' '] = 025552, ['P' - ' '] = 065644,
+	['Q' - ' '] = 025563, ['R' - ' '] = 065655, ['S' - ' '] = 034216, ['T' - ' '] = 072222,
+	['U' - ' '] = 055557, ['V' - ' '] = 055552, ['W' - ' '] = 055775, ['X' - ' '] = 055255,
+	['Y' - ' '] = 055222, ['Z' - ' '] = 071247,
+	['%' - ' '] = 051245, ['.' - ' '] = 000002, [':' - ' '] = 002020, ['-' - ' '] = 000700,
+	['/' - ' '] = 011244, ['+' - ' '] = 002720,
+};
+
+#define GLYPH_W 3
+#define GLYPH_H 5
+#define ADVANCE 4       // Glyph plus a column of space
+#define LINE_STEP 7     // Glyph plus two rows of space
+
+#pragma endregion
+
+#pragma region Drawing
+
+#define TEXT_COLOUR 0xFFFFFF
+#define BAR_EMPTY 0x404040
+#define BAR_OVER 0xFF4040   // Phase took longer than a whole frame
+
+// Bar fill per phase, in row order.
+static const u32 phase_colour[4] = { 0x40C0FF, 0x60E060, 0xFFC040, 0xC080FF };
+
+// The canvas the overlay is being drawn on, and the size of one font pixel.
+static struct {
+	u32 *dst;
+	int pitch;
+	int width;
+	int height;
+	int unit;
+} canvas;
+
+static void fill(int x, int y, int w, int h, u32 colour) {
+	if (x + w > canvas.width) {
+		w = canvas.width - x;
+	}
+	if (y + h > canvas.height) {
+		h = canvas.height - y;
+	}
+	for (int row = y; row < y + h; row++) {
+		u32 *p = canvas.dst + (size_t)row * canvas.pitch;
+		for (int col = x; col < x + w; col++) {
+			p[col] = colour;
+		}
+	}
+}
+
+// Halves the brightness under the panel so the text reads on any picture.
+static void darken(int x, int y, int w, int h) {
+	if (x + w > canvas.width) {
+		w = canvas.width - x;
+	}
+	if (y + h > canvas.height) {
+		h = canvas.height - y;
+	}
+	for (int row = y; row < y + h; row++) {
+		u32 *p = canvas.dst + (size_t)row * canvas.pitch;
+		for (int col = x; col < x + w; col++) {
+			p[col] = (p[col] >> 1) & 0x7F7F7F;
+		}
+	}
+}
+
+// Draws "str" at font pixel position (x, y), returns the x after it.
+static int text(int x, int y, const char *str) {
+	int u = canvas.unit;
+	for (; *str; str++, x += ADVANCE) {
+		int c = *str;
+		if (c >= 'a' && c <= 'z') {
+			c -= 'a' - 'A';
+		}
+		if (c < ' ' || c > '_') {
+			continue;
+		}
+		u16 glyph = font[c - ' '];
+		for (int row = 0; row < GLYPH_H; row++) {
+			for (int col = 0; col < GLYPH_W; col++) {
+				if (glyph & (1 << ((GLYPH_H - 1 - row) * GLYPH_W + (GLYPH_W - 1 - col)))) {
+					fill((x + col) * u, (y + row) * u, u, u, TEXT_COLOUR);
+				}
+			}
+		}
+	}
+	return x;
+}
+
+// A bar "length" font pixels long, "share" of it filled.
+static void bar(int x, int y, int length, double share, u32 colour) {
+	int u = canvas.unit;
+	if (share > 1) {
+		share = 1;
+		colour = BAR_OVER;
+	}
+	if (share < 0) {
+		share = 0;
+	}
+	int filled = (int)(share * length * u + 0.5);
+	fill(x * u, y * u, length * u, GLYPH_H * u, BAR_EMPTY);
+	fill(x * u, y * u, filled, GLYPH_H * u, colour);
+}
+
+#pragma endregion
+
+#define MARGIN 2
+#define BAR_LENGTH 32
+#define PANEL_W (MARGIN * 2 + ADVANCE * 4 + BAR_LENGTH + 1 + ADVANCE * 5)
+#define PANEL_ROWS 11
+
+void hud_draw(u32 *dst, int dst_pitch, int width, int height, const struct hud_stats *stats) {
+	canvas.dst = dst;
+	canvas.pitch = dst_pitch;
+	canvas.width = width;
+	canvas.height = height;
+	// About as big as the game's own pixels at twice the native size.
+	canvas.unit = height / 288 > 1 ? height / 288 : 1;
+
+	int u = canvas.unit;
+	darken(0, 0, PANEL_W * u, (MARGIN * 2 + PANEL_ROWS * LINE_STEP - 2) * u);
+
+	char buf[32];
+	int x = MARGIN;
+	int y = MARGIN;
+
+	snprintf(buf, sizeof(buf), "FPS %.1f", stats->fps);
+	text(x, y, buf);
+	y += LINE_STEP;
+	snprintf(buf, sizeof(buf), "SPD %.0f%%", stats->speed);
+	text(x, y, buf);
+	y += LINE_STEP;
+	snprintf(buf, sizeof(buf), "IPF %llu", (unsigned long long)stats->instructions);
+	text(x, y, buf);
+	y += LINE_STEP;
+	snprintf(buf, sizeof(buf), "SKP %llu", (unsigned long long)stats->skipped);
+	text(x, y, buf);
+	y += LINE_STEP;
+
+	// Phase bars are full at one guest frame.
+	const char *phase_name[4] = { "CPU", "RND", "PRS", "AUD" };
+	double phase_ms[4] = { stats->cpu_ms, stats->render_ms, stats->present_ms, stats->audio_ms };
+	for (int i = 0; i < 4; i++) {
+		int bar_x = text(x, y, phase_name[i]) + 1;
+		bar(bar_x, y, BAR_LENGTH, phase_ms[i] / stats->frame_ms, phase_colour[i]);
+		snprintf(buf, sizeof(buf), "%.1f", phase_ms[i]);
+		text(bar_x + BAR_LENGTH + 1, y, buf);
+		y += LINE_STEP;
+	}
+
+	int bar_x = text(x, y, "BUF") + 1;
+	bar(bar_x, y, BAR_LENGTH, stats->audio_fill, phase_colour[3]);
+	snprintf(buf, sizeof(buf), "%.0f%%", stats->audio_fill * 100);
+	text(bar_x + BAR_LENGTH + 1, y, buf);
+	y += LINE_STEP;
+
+	snprintf(buf, sizeof(buf), "LAT %.0fMS %+.0fPPM", stats->audio_latency_ms, stats->audio_drift_ppm);
+	text(x, y, buf);
+	y += LINE_STEP;
+
+	snprintf(buf, sizeof(buf), "UND %u OVR %u", stats->audio_underruns, stats->audio_overruns);
+	text(x, y, buf);
+}
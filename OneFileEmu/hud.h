@@ -0,0 +1,34 @@
+/**
+ * Performance overlay.
+ * Draws frame rate, emulated speed and per-phase frame times over the top
+ * left corner of the scaled output, with a built-in 3x5 pixel font. The
+ * overlay is drawn straight into the output image, after scaling, so it
+ * stays sharp whatever the filter.
+ */
+
+#pragma once
+
+#include "qol.h"
+
+struct hud_stats {
+	double fps;            // Frames presented per second
+	double speed;          // Emulated speed, % of DMG_CLOCK_FREQ
+	u64 instructions;      // Guest instructions in the last emulated frame
+	double frame_ms;       // Length of a guest frame, the full width of a bar
+	double cpu_ms;         // Emulating the CPU, timers and interrupts
+	double render_ms;      // Finishing the frame in the PPU renderer
+	double present_ms;     // Output stage and present
+	double audio_ms;       // Synthesising the last frame's audio
+	double audio_fill;     // Share of the audio ring filled, 0 to 1
+	double audio_latency_ms; // Audio queued, as rate control sees it
+	double audio_drift_ppm;  // Audio clock against ours
+	unsigned audio_underruns; // Callbacks left short
+	unsigned audio_overruns;  // Synthesis blocks the ring dropped
+	u64 skipped;           // Frames dropped by the frameskip
+};
+
+/**
+ * Draw the overlay into the XRGB8888 image "dst" ("width" x "height"
+ * pixels, rows "dst_pitch" pixels apart). The font is scaled with the image.
+ */
+void hud_draw(u32 *dst, int dst_pitch, int width, int height, const struct hud_stats *stats);
@@ -2,25 +2,55 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <windows.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "qol.h"
 #include "opcodes_cb.h"
 #include "opcodes_main.h"
 #include "apu.h"
-#include <SDL2\SDL.h>
-
-// Screen Dimensions.
+#include "pacer.h"
+#include "platform.h"
+#include "handoff.h"
+#include "hud.h"
+#include "ppu.h"
+#include "ppu_simd.h"
+#include "scaler.h"
+#include "wav.h"
+
+// Screen Dimensions, scale and filter can be changed from the command line.
 int scale = 6;
-#define SCREEN_WIDTH 960 // (160 * scale)
-#define SCREEN_HEIGHT 864 // (144 * scale)
+int scaler_filter = SCALER_NEAREST;
+int scaler_threads = -1; // -1 picks from the CPU count
+int render_threads = -1; // PPU render threads, 0 draws on the emulation thread
+bool bench_scalers = false;
+bool selftest = false;   // Check the SIMD kernels against the scalar ones and exit
+bool vsync = false;      // Let the display pace presents instead of the pacer
+int frameskip = 0;       // Most frames in a row auto-frameskip may drop, 0 is off
+bool show_hud = false;   // Performance overlay, H toggles it
+int run_frames = 0;      // Stop after this many frames, 0 runs until quit
+const char* screenshot_path = NULL; // Where to save the last frame shown on exit
+int audio_synthesis = AUDIO_SYNTH_CLASSIC;
+double audio_drc_ms = 0; // Audio to keep queued under rate control, 0 is off
+double audio_latency_ms = 0; // Adaptive low latency margin, 0 is off
+int audio_device_rate = (int)AUDIO_SAMPLE_RATE; // Rate to ask the device for
+int audio_decimation = 1; // Synthesise one frame of audio in this many, 0 for none
+const char* wav_path = NULL; // Render the audio here, unpaced, instead of playing it
+int gbs_track = 0;       // Song of a GBS rip to play, 0 is the rip's first
+#define SCREEN_WIDTH (160 * scale)
+#define SCREEN_HEIGHT (144 * scale)
 
 
 // Clockspeed.
 #define CLOCKSPEED 4194304
 #define CYCLES_PER_FRAME 69905  
 
+// Scanlines of audio synthesised and paced at a time for --audio-latency.
+#define AUDIO_SLICE_LINES 16
+#define AUDIO_SLICE_CYCLES (AUDIO_SLICE_LINES * 456)
+
 #pragma region Global Vars
 
 int timer_count = 0;
@@ -41,12 +71,35 @@ bool interrupt_master_enable = 0;  // Interrupt Master Enable Flag.
 
 // Graphics Variables
 int scanline_count;
-u8 Tiles[384][8][8];
-struct RGB {
-	u8 r;
-	u8 g;
-	u8 b;
-} frame_buffer[SCREEN_HEIGHT][SCREEN_WIDTH], color_pallete[4];
+
+// The emulation runs on its own thread; the main thread owns the platform,
+// shows the frames it publishes and forwards input to it.
+atomic_bool emulation_running = true;
+long long instruction_count = 0;
+
+// Timings for the performance overlay, in performance counter ticks. The
+// emulation thread updates its counters once a frame and the audio callback
+// once a buffer; the overlay reads whatever is latest.
+atomic_llong emulated_cycles;       // Guest cycles run since start
+atomic_llong frame_instructions;    // Guest instructions in the last frame
+atomic_llong frame_cpu_ticks;       // Last frame's CPU, timers and interrupts
+atomic_llong frame_render_ticks;    // Last frame's ppu_end_frame()
+atomic_llong frames_skipped;
+atomic_llong frame_audio_ticks;     // Last frame's audio synthesis
+long long audio_pending_ticks;      // Synthesis since the last frame ended
+long long slice_wait_ticks;         // Pacing between slices since then
+bool audio_slicing;                 // Synthesise and pace in slices of the frame
+struct wav_file* wav_out;           // Where --wav writes the audio
+struct hud_stats hud;
+
+// Output stage buffer, XRGB8888. resolved_frame is the scaler input, which
+// scales into the platform's frame.
+u32 resolved_frame[144][160];
+
+// The four shades in the output format, and for every value of a palette
+// register (BGP, OBP0, OBP1) the shades of colours 0-3 through it.
+const u32 shades[4] = { 0xFFFFFF, 0xB4B4B4, 0x6E6E6E, 0x000000 };
+u32 palette_lut[256][4];
 
 // Joypad Variable
 u8 controller_state = 0xFF;
@@ -73,6 +126,7 @@ $0000-$00FF     Restart and Interrupt Vectors
 #define ALT_CART 0
 u8 ram[65536] = { 0 };
 u8* rom;
+u32 rom_size = 0;
 u8 bank_offset = 0;
 int num_of_banks = 2;//Default based off of Tetris
 bool mbc1 = false;
@@ -141,19 +195,20 @@ u8 int_timer = 2;
 u8 int_serial = 3;
 u8 int_joypad = 4;
 
-// SDL State
-SDL_Event event;
-SDL_Renderer* renderer;
-SDL_Window* window;
-SDL_Texture* texture;
-SDL_Surface* logo;
+// Platform State
+struct platform_event event;
 #pragma endregion
 
 #pragma region Function Decs
+// Command Line
+char* parse_args(int argc, char** argv); // Reads the options, returns the ROM path.
+void print_usage();
+
 // Rom Loading
 void load_rom(char* filename);
 void direct_load_rom(u8* buffer);
 void detect_banking_mode();
+bool load_gbs();          // Maps a GBS rip in as the cartridge, if that is what was loaded.
 
 void load_save();
 void save_game();
@@ -162,7 +217,8 @@ void save_game();
 u8 controller_reg_state();        // Sets up FF00 depending on key presses.
 void key_press(int key);    // Does a key press
 void key_release(int key);  // Does a key release
-void handle_input();        // Detects key presses.
+void handle_input();        // Turns platform key events into input events for the emulation thread.
+void apply_input();         // Applies queued input events, on the emulation thread.
 
 // ram Operations
 u8 bus_read(u16 address);              // Read ram at address.
@@ -176,19 +232,24 @@ void execute_interrupt(u8 interupt);    // Carries out the specified interupt an
 void enable_interrupt(u8 interupt);   // Allows for check_interrupts to be set.
 void print_cpu_regs();                // Prints cpu_regs info.
 void update_timers();
+u64 cycle_now();                      // Guest cycles since start, on the emulation thread.
 
 // Graphics functions.
-void init_HAL();       // Starts SDL Window and render surface.
-void setup_color_pallete();  // Sets up the colours. (Todo: load from rom)
-void load_tiles();           // Loads Tiles into Array Tiles[][x][y].
-void render_tile_map_line(); // Arranges tiles according to tilemap and displays
-// onto
-// screen.
-
-void render_sprites();    // Renders the sprites.
-void display_buffer();    // Loads buffer into texture and renders it.
-void render_graphics();   // Combines above.
-void shutdown_emu();          // Shuts down SDL and exits.
+void init_HAL();       // Opens the platform's output.
+void setup_palette_luts();  // Fills palette_lut for every palette register value.
+void ppu_bus_write(u8 value, u16 address); // Stores a VRAM/OAM/LCD register write and journals it for the renderer.
+void output_frame(const struct ppu_output* frame); // Resolves the frame's colours and scales them into the platform's frame.
+void display_buffer();    // Presents the platform's frame.
+bool save_screenshot(const char* path); // Writes the last frame shown as a PPM, false if it can't.
+void render_graphics(const struct ppu_output* frame);   // Publishes a frame and paces the emulation.
+void end_frame();         // VBlank: finishes, publishes and paces the frame.
+void audio_slice(double done); // Synthesises up to now and paces to "done" of the frame.
+void update_hud(long long present_ticks); // Gathers the overlay's numbers on the presentation thread.
+void* emulation_main(void* arg); // Emulation thread: CPU, timers, PPU, APU.
+void* gbs_main(void* arg);       // Emulation thread for a GBS rip: its routines and the APU only.
+void gbs_call(u16 address, long budget); // Calls a GBS routine until it returns.
+void write_wav(const float* samples, unsigned frames); // Audio sink for --wav.
+void shutdown_emu(int status); // Shuts down the platform and exits with "status".
 void set_lcd_status();    // Sets the lcd status register [0xFF41] according to
 // the
 // current scanline.
@@ -787,13 +848,44 @@ const struct instruction CB_instructions[] = {
 
 int main(int argc, char** argv) {
 
+	char* rom_path = parse_args(argc, argv);
+
+	if (scaler_filter < 0 || !scaler_supports(scaler_filter, scale)) {
+		printf("Unsupported --filter/--scale combination\n");
+		print_usage();
+		return -1;
+	}
+
+	// A small pool, the caller thread scales one band itself.
+	if (scaler_threads < 0) {
+		scaler_threads = platform_cpu_count() - 1;
+		if (scaler_threads > 3) {
+			scaler_threads = 3;
+		}
+	}
+	scaler_init(scaler_threads);
+
+	if (bench_scalers) {
+		scaler_benchmark(scale, 500);
+		scaler_shutdown();
+		return 0;
+	}
+
+	if (selftest) {
+		bool passed = ppu_simd_selftest();
+		passed = scaler_selftest() && passed;
+		passed = audio_selftest() && passed;
+		scaler_shutdown();
+		return passed ? 0 : 1;
+	}
+
 #if ALT_CART == 0
-	if (argc < 2) {
-        printf("Usage: emu <rom_file>\n");
+	if (rom_path == NULL) {
+        print_usage();
         return -1;
     }
 	else {
-		load_rom(argv[1]);
+		load_rom(rom_path);
 	}
 #endif
 
@@ -828,42 +920,185 @@ int main(int argc, char** argv) {
     direct_load_rom(buffer);
 #endif
 
-	detect_banking_mode();
+	bool gbs_mode = load_gbs();
+	if (!gbs_mode) {
+		detect_banking_mode();
+	}
+
+	ppu_simd_init();
+	printf("-PPU KERNELS: %s-\n", ppu_simd_name());
 
-	setup_color_pallete();
+	// Frames are drawn on a render thread while the next one is emulated,
+	// with helpers drawing bands of lines on bigger machines.
+	if (gbs_mode) {
+		render_threads = 0;
+	}
+	else if (render_threads < 0) {
+		render_threads = platform_cpu_count() > 1 ? platform_cpu_count() - 1 : 0;
+		if (render_threads > 4) {
+			render_threads = 4;
+		}
+	}
+	ppu_init(ram, render_threads);
+
+	setup_palette_luts();
 	init_HAL();
 
 	// APU TEST ZONE
 	#pragma region APU
-    SDL_AudioDeviceID dev;
-    SDL_AudioSpec want, have;
-
-    want.freq = AUDIO_SAMPLE_RATE;
-    want.format = AUDIO_F32SYS, want.channels = 2;
-    want.samples = AUDIO_SAMPLES;
-    want.callback = audio_callback;
-    want.userdata = NULL;
-
-    printf("Audio driver: %s\n", SDL_GetAudioDeviceName(0, 0));
-
-    if ((dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0)) == 0) {
-        printf("SDL could not open audio device: %s\n", SDL_GetError());
-        exit(EXIT_FAILURE);
+    int audio_rate, audio_samples;
+
+    // A video frame's worth by default. For low latency, the largest power
+    // of two that fits in the margin, so a callback never asks for more
+    // than the margin holds.
+    int device_samples = (int)(AUDIO_SAMPLES * audio_device_rate / AUDIO_SAMPLE_RATE);
+    if (audio_latency_ms > 0) {
+        device_samples = 32;
+        while (device_samples * 2 <= audio_latency_ms * audio_device_rate / 1000) {
+            device_samples *= 2;
+        }
     }
 
     audio_init();
-    SDL_PauseAudioDevice(dev, 0);
+    audio_set_synthesis(audio_synthesis);
+    audio_set_decimation(audio_decimation);
+    printf("-APU KERNELS: %s-\n", audio_simd_name());
+    if (wav_path) {
+        // Offline: synthesis writes straight to the file and there is no
+        // device to keep up with, so nothing needs pacing.
+        if (!audio_set_device_rate(audio_device_rate)) {
+            printf("*Can't resample to %d Hz*\n", audio_device_rate);
+            exit(EXIT_FAILURE);
+        }
+        wav_out = wav_open(wav_path, audio_device_rate);
+        if (!wav_out) {
+            printf("*Could not create %s*\n", wav_path);
+            exit(EXIT_FAILURE);
+        }
+        audio_set_sink(write_wav);
+        if (run_frames == 0) {
+            run_frames = (int)(60 * VERTICAL_SYNC);
+        }
+    }
+    else {
+        if (!platform_open_audio(audio_device_rate, device_samples, audio_callback,
+            &audio_rate, &audio_samples)) {
+            exit(EXIT_FAILURE);
+        }
+        // The device may run at a rate of its own: synthesis doesn't
+        // change, its output is resampled to whatever the device got.
+        if (audio_rate != AUDIO_SAMPLE_RATE) {
+            if (audio_set_device_rate(audio_rate)) {
+                printf("Audio device: %d Hz, resampled from %d Hz\n", audio_rate, (int)AUDIO_SAMPLE_RATE);
+            }
+            else {
+                printf("Audio device: %d Hz can't be resampled to, pitch will be off\n", audio_rate);
+            }
+        }
+        if (audio_drc_ms > 0 && audio_latency_ms <= 0) {
+            audio_set_rate_control(true, audio_drc_ms, audio_samples);
+            struct audio_stats drc;
+            audio_get_stats(&drc);
+            if (drc.target_ms > audio_drc_ms) {
+                printf("Audio rate control: %.1f ms can't cover the device's buffer, keeping %.1f ms\n",
+                    audio_drc_ms, drc.target_ms);
+            }
+        }
+        if (audio_latency_ms > 0) {
+            printf("Audio device buffer: %d frames\n", audio_samples);
+            // A frame of audio made at once would have to stay queued on
+            // top of the margin, so synthesis keeps closer behind.
+            audio_slicing = true;
+            audio_set_adaptive_latency(audio_latency_ms, audio_samples,
+                (unsigned)ceil(AUDIO_SLICE_CYCLES * AUDIO_SAMPLE_RATE / DMG_CLOCK_FREQ));
+        }
+    }
 	#pragma endregion
-	// Main loop.
+	// Unpaced for --wav: there is no device to keep up with.
+	pacer_init(VERTICAL_SYNC, wav_out != NULL);
+	pacer_set_frameskip(frameskip);
+
+	// Main loop. The emulation runs on its own thread, this one presents.
+	pthread_t emulation_thread;
+	u64 start = platform_ticks();
+	if (pthread_create(&emulation_thread, NULL, gbs_mode ? gbs_main : emulation_main, NULL) != 0) {
+		printf("Could not start the emulation thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (atomic_load(&emulation_running)) {
+		// Read inputs from the platform
+		while (platform_poll_event(&event)) {
+			if (event.kind == EVENT_QUIT) {
+				atomic_store(&emulation_running, false);
+			}
+			handle_input();
+		}
+
+		// Show the newest frame, if there is one.
+		const struct ppu_output* frame = handoff_latest();
+		if (frame) {
+			u64 present_start = platform_ticks();
+			output_frame(frame);
+			display_buffer();
+			update_hud(platform_ticks() - present_start);
+		}
+		else {
+			platform_sleep_ms(1);
+		}
+	}
+
+	pthread_join(emulation_thread, NULL);
+	print_cpu_regs();
+	u64 end = platform_ticks();
+	printf("%lld instructions in %d ms\n", instruction_count, (int)((end - start) * 1000 / platform_tick_rate()));
+	pacer_print_stats();
+	if (wav_out) {
+		// Decimated, less is written than was emulated.
+		struct pacer_stats paced;
+		pacer_get_stats(&paced);
+		double emulated = paced.frames / VERTICAL_SYNC;
+		printf("Audio: %.2f s written to %s, %.2f s emulated at %.1fx real time\n",
+			(double)wav_frames(wav_out) / audio_device_rate, wav_path, emulated,
+			emulated * platform_tick_rate() / (double)(end - start));
+		wav_close(wav_out);
+	}
+	else {
+		struct audio_stats audio;
+		audio_get_stats(&audio);
+		if (audio_drc_ms > 0 || audio_latency_ms > 0) {
+			printf("Audio: latency %.1f ms (target %.1f), ratio %.6f, drift %+.0f ppm\n",
+				audio.latency_ms, audio.target_ms, audio.ratio, audio.drift_ppm);
+		}
+		printf("Audio: %u underruns, %u overruns, callback jitter %.2f ms (max %.2f)\n",
+			audio.underruns, audio.overruns, audio.jitter_ms, audio.jitter_max_ms);
+	}
+	// Quitting, or running out of --frames, is a normal end; only a
+	// screenshot that couldn't be saved fails the run.
+	int status = EXIT_SUCCESS;
+	if (screenshot_path && !save_screenshot(screenshot_path)) {
+		status = EXIT_FAILURE;
+	}
+	shutdown_emu(status);
+
+#if ALT_CART == 1
+    free(buffer);
+    return 0;
+#endif
+}
+
+// Runs the emulation until the presentation thread stops it. Input is taken
+// in between batches of CYCLES_PER_FRAME cycles, as the platform events were.
+void* emulation_main(void* arg) {
+	(void)arg;
 	cpu_regs.pc = 0;
-	int count = 0;
-	Uint32 start = SDL_GetTicks();
-	while (1) {
+
+	while (atomic_load(&emulation_running)) {
 		cur_cycle_count = 0;
 		while (cur_cycle_count < CYCLES_PER_FRAME) {
 
 			cpu_cycle();
-			count++;
+			instruction_count++;
 			//printf("\nSTEP1\n");
 			update_timers();
 			//printf("\nSTEP2\n");
@@ -873,27 +1108,127 @@ int main(int argc, char** argv) {
 			//printf("\nSTEP4\n");
 		}
 
-		// Read inputs from SDL
-		while (SDL_PollEvent(&event)) {
-			if (event.type == SDL_QUIT) {
-				print_cpu_regs();
-				Uint32 end = SDL_GetTicks();
-				printf("%d instructions in %d ms\n", count, end - start);
-				shutdown_emu();
-				break;
-			}
-			//printf("CONTROLS TIME");
-			handle_input();
+		atomic_fetch_add(&emulated_cycles, cur_cycle_count);
+
+		// Sound for the batch, with the APU writes landing on the cycles
+		// they were made on.
+		u64 synth_start = platform_ticks();
+		audio_run(atomic_load(&emulated_cycles));
+		audio_pending_ticks += platform_ticks() - synth_start;
+
+		apply_input();
+	}
+	return NULL;
+}
+
+// Offline rendering: every block the APU synthesises goes to the file, on
+// the emulation thread.
+void write_wav(const float* samples, unsigned frames) {
+	wav_write(wav_out, samples, frames);
+}
+
+#pragma region Command Line
+
+char* parse_args(int argc, char** argv) {
+	char* rom_path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+			scale = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			scaler_filter = scaler_filter_from_name(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			scaler_threads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--render-threads") == 0 && i + 1 < argc) {
+			render_threads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--frameskip") == 0 && i + 1 < argc) {
+			frameskip = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--vsync") == 0) {
+			vsync = true;
+		}
+		else if (strcmp(argv[i], "--hud") == 0) {
+			show_hud = true;
+		}
+		else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			run_frames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+			run_frames = (int)ceil(atof(argv[++i]) * VERTICAL_SYNC);
+		}
+		else if (strcmp(argv[i], "--screenshot") == 0 && i + 1 < argc) {
+			screenshot_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--audio-drc") == 0 && i + 1 < argc) {
+			audio_drc_ms = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--audio-latency") == 0 && i + 1 < argc) {
+			audio_latency_ms = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--audio-rate") == 0 && i + 1 < argc) {
+			audio_device_rate = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--audio-decimate") == 0 && i + 1 < argc) {
+			audio_decimation = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc) {
+			wav_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--track") == 0 && i + 1 < argc) {
+			gbs_track = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--audio-synth") == 0 && i + 1 < argc) {
+			i++;
+			audio_synthesis = strcmp(argv[i], "blep") == 0 ? AUDIO_SYNTH_BLEP : AUDIO_SYNTH_CLASSIC;
+		}
+		else if (strcmp(argv[i], "--bench-scalers") == 0) {
+			bench_scalers = true;
+		}
+		else if (strcmp(argv[i], "--selftest") == 0) {
+			selftest = true;
+		}
+		else {
+			rom_path = argv[i];
 		}
 	}
-	shutdown_emu();
+	return rom_path;
+}
 
-#if ALT_CART == 1
-    free(buffer);
-    return 0;
-#endif
+void print_usage() {
+	printf("Usage: emu [options] <rom_file or gbs_file>\n");
+	printf("  --scale N          window scale (default 6)\n");
+	printf("  --filter NAME      nearest, scale2x, scale3x or xbr (default nearest)\n");
+	printf("  --threads N        scaler worker threads\n");
+	printf("  --render-threads N PPU render threads, 0 renders on the emulation thread\n");
+	printf("  --vsync            present in step with the display\n");
+	printf("  --frameskip N      skip up to N frames in a row while running behind\n");
+	printf("  --hud              start with the performance overlay shown (H toggles it)\n");
+	printf("  --frames N         stop after N frames\n");
+	printf("  --seconds S        stop after S seconds of emulated time\n");
+	printf("  --screenshot FILE  save the last frame shown as a PPM on exit\n");
+	printf("  --audio-synth NAME classic or blep (band-limited, cheaper with many channels)\n");
+	printf("  --audio-drc MS     lock to the audio clock, keeping MS of audio queued\n");
+	printf("  --audio-latency MS small device buffer, MS of audio queued beyond what is\n");
+	printf("                     synthesised at once, a few scanlines' worth,\n");
+	printf("                     grown on underruns and eased back when stable\n");
+	printf("  --audio-rate HZ    output rate to ask for (default 48000), synthesis stays\n");
+	printf("                     at 48000 and is resampled to what the device gives\n");
+	printf("  --audio-decimate N synthesise one frame of audio in N, 0 for none, when\n");
+	printf("                     running faster than real time; sound registers stay exact\n");
+	printf("  --wav FILE         write the audio to FILE as fast as the host can run,\n");
+	printf("                     without a device (60 seconds unless told otherwise)\n");
+	printf("  --track N          song to play from a .gbs rip (default: its first)\n");
+	printf("  --bench-scalers    time every scaler and exit\n");
+	printf("  --selftest         check the SIMD kernels against the scalar ones, the\n");
+	printf("                     resampler and audio decimation, and exit\n");
 }
 
+#pragma endregion
+
 #pragma region cart
 
 void load_rom(char *filepath){
@@ -905,7 +1240,7 @@ void load_rom(char *filepath){
     printf("-Opened: %s-\n", filepath);
 
     fseek(fptr, 0, SEEK_END);
-    u32 rom_size = ftell(fptr);
+    rom_size = ftell(fptr);
     
     rewind(fptr);
     //rom is a u8*
@@ -983,7 +1318,7 @@ u8 bus_read(u16 address) {
 
 	if(address >= 0xFF10 && address <= 0xFF3F){
         //To do: Sound!
-        return audio_read(address);
+        return audio_read(address, cycle_now());
     }
 
 	if (address == 0xFF00) {
@@ -1027,11 +1362,11 @@ void bus_write(u8 value, u16 address) {
     }
 
 	if (address >= 0xFF10 && address <= 0xFF3F){
-		audio_write(address, value);
+		audio_write(address, value, cycle_now());
 	}
 
 	else if (address >= 0x2000 && address <= 0x3FFF) {
-		bank_offset = value - 1;
+		bank_offset = value ? value - 1 : 0; // Bank 0 selects 1, as on MBC1
 	}
 
 	// Writing to read only ram
@@ -1049,12 +1384,22 @@ void bus_write(u8 value, u16 address) {
 		ram[0xFF44] = 0;
 	}
 
+	// LCDC, SCY, SCX, BGP, OBP0, OBP1, WY and WX
+	else if (address == 0xFF40 || address == 0xFF42 || address == 0xFF43 || (address >= 0xFF47 && address <= 0xFF4B)) {
+		ppu_bus_write(value, address);
+	}
+
 	// Reset the divider register
 	else if (address == 0xFF04) {
 		ram[0xFF04] = 0;
 		divider_count = 0;
 	}
 
+	// OAM and VRAM, the renderer has its own copy
+	else if ((address >= 0xFE00 && address <= 0xFE9F) || (address >= 0x8000 && address <= 0x9FFF)) {
+		ppu_bus_write(value, address);
+	}
+
 	else {
 		ram[address] = value;
 	}
@@ -1070,194 +1415,334 @@ void dma_transfer(u8 value) {
     //printf("INIT DMA: 0x%04X to 0x%04X\n", source, source_end);
 
     for(int i = 0; i < 160; i++){
-        bus_write(bus_read(source+i), dest + i);
+        ppu_bus_write(bus_read(source+i), dest + i);
     }
 }
 
-#pragma endregion
-
-#pragma region Graphics and Gamepad
-
-void load_tiles() {
-	int s = 0;
-	int Rel_x = 0;
-	int Rel_y = 0;
-	int bitIndex;
-
-	int address = 0x8000;
-
-	while (s < 384) {
-		Rel_y = 0;
-		while (Rel_y < 8) {
-			Rel_x = 0;
-			while (Rel_x < 8) {
-				bitIndex = 1 << (7 - Rel_x);
-				Tiles[s][Rel_x][Rel_y] = (bus_read(address + 2 * Rel_y + 16 * s) & bitIndex ? 1 : 0) + ((bus_read(address + 1 + 2 * Rel_y + 16 * s) & bitIndex) ? 2 : 0);
-				Rel_x++;
-			}
-			Rel_y++;
-		}
-		s++;
+// Writes that change what the PPU draws. Rewriting the value already there
+// changes nothing, so only real changes reach the renderer's journal.
+void ppu_bus_write(u8 value, u16 address) {
+	if (ram[address] != value) {
+		ram[address] = value;
+		ppu_write(address, value, ram[0xFF44]);
 	}
 }
 
-void render_tile_map_line() {
-	// Check if LCD is enabled
-	if (!Bit_Test_no_flags(7, bus_read(0xFF40))) {
-		return;
-	}
-
-	u8 currentline = bus_read(0xFF44);
-
-	if (currentline >= 144) {
-		return;
-	}
-
-	u8 ScrollY = bus_read(0xFF42);
-	u8 ScrollX = bus_read(0xFF43);
-	u8 WindowY = bus_read(0xFF4A);
-	u8 WindowX = bus_read(0xFF4B);
+#pragma endregion
 
-	// Which tile value?
-	bool unsig = true;
-	if (!Bit_Test_no_flags(4, bus_read(0xFF40))) {
-		unsig = false;
-	}
+#pragma region GBS
+
+// GBS music rips: a header, then code and data that load at the header's
+// load address as if they were a cartridge's ROM, banked like MBC1 above
+// 0x4000. init is called once with the song in A, then play at the rip's
+// timer rate, or VBlank's when the timer is left off. There is no video,
+// nothing reaches the PPU.
+#define GBS_HEADER_SIZE 0x70
+#define GBS_BANKS 256
+#define GBS_RETURN 0xF00D  // Return address the calls push, where no rip code lives
+
+struct {
+	u8 songs;
+	u8 first_song;  // 1 based
+	u16 load;
+	u16 init;
+	u16 play;
+	u16 sp;
+	long period;    // Cycles between play calls
+} gbs;
+
+// The header's words are little endian.
+static u16 gbs_word(const u8* at) {
+	return at[0] | (at[1] << 8);
+}
 
-	// Are we using windowing?
-	bool windowingEnabled = false;
-	if (Bit_Test_no_flags(5, bus_read(0xFF40))) {
-		windowingEnabled = true;
+bool load_gbs() {
+	if (rom_size < GBS_HEADER_SIZE || memcmp(rom, "GBS", 3) != 0) {
+		return false;
 	}
-
-	// Check which tilemap to render.
-	int address;
-	if (Bit_Test_no_flags(3, bus_read(0xFF40))) {
-		address = 0x9C00;
+	u8* file = rom;
+	u32 data_size = rom_size - GBS_HEADER_SIZE;
+
+	gbs.songs = file[0x04];
+	gbs.first_song = file[0x05] ? file[0x05] : 1;
+	gbs.load = gbs_word(file + 0x06);
+	gbs.init = gbs_word(file + 0x08);
+	gbs.play = gbs_word(file + 0x0A);
+	gbs.sp = gbs_word(file + 0x0C);
+	printf("-GBS: %.32s - %.32s, %d songs-\n", file + 0x10, file + 0x30, gbs.songs);
+
+	// TIMA counts at the TAC clock and play runs on every overflow, twice as
+	// often with the CGB double speed bit.
+	u8 tma = file[0x0E];
+	u8 tac = file[0x0F];
+	if (tac & 0x04) {
+		static const long timer_clocks[4] = { 1024, 16, 64, 256 };
+		gbs.period = timer_clocks[tac & 0x3] * (256 - tma);
+		if (tac & 0x80) {
+			gbs.period /= 2;
+		}
 	}
 	else {
-		address = 0x9800;
+		gbs.period = (long)SCREEN_REFRESH_CYCLES;
 	}
+	printf("-GBS PLAY RATE: %.2f Hz-\n", DMG_CLOCK_FREQ / gbs.period);
 
-	int window_address;
-	if (Bit_Test_no_flags(6, bus_read(0xFF40))) {
-		window_address = 0x9C00;
-	}
-	else {
-		window_address = 0x9800;
+	if (gbs.load + data_size > GBS_BANKS * 0x4000) {
+		printf("*GBS data doesn't fit below bank %d*\n", GBS_BANKS);
+		exit(EXIT_FAILURE);
 	}
 
-	int yPos = currentline + ScrollY;
-	int tileRow = (yPos / 8) % 32 * 32;
+	// Every bank a write can select exists. The RST vectors jump to the
+	// rip's own, at the same offsets from its load address.
+	rom = calloc(GBS_BANKS, 0x4000);
+	for (int vector = 0; vector < 0x40; vector += 8) {
+		u16 target = gbs.load + vector;
+		rom[vector + 0] = 0xC3; // JP a16
+		rom[vector + 1] = target & 0xFF;
+		rom[vector + 2] = target >> 8;
+	}
+	memcpy(rom + gbs.load, file + GBS_HEADER_SIZE, data_size);
+	free(file);
+	rom_size = GBS_BANKS * 0x4000;
+	num_of_banks = GBS_BANKS;
+	return true;
+}
 
-	int pixel = 0;
-	// Draw non-windowed component
-	for (; pixel < 160; pixel++) {
-		if (windowingEnabled && pixel >= WindowX && currentline >= WindowY) {
-			break;
-		}
-		int xPos = pixel + ScrollX;
-		int tileColumn = (xPos / 8) % 32;
+// Runs a rip's routine as its player would, until it returns to
+// GBS_RETURN or "budget" cycles have gone by, whichever is first.
+void gbs_call(u16 address, long budget) {
+	long deadline = cur_cycle_count + budget;
+	Push(GBS_RETURN);
+	cpu_regs.pc = address;
+	while (cpu_regs.pc != GBS_RETURN && cur_cycle_count < deadline) {
+		cpu_cycle();
+		instruction_count++;
+	}
+}
 
-		int tileNum;
-		if (unsig) {
-			tileNum = bus_read(address + tileRow + tileColumn);
-		}
-		else {
-			tileNum = (signed char)bus_read(address + tileRow + tileColumn) + 0x100;
+// A video frame's worth of cycles at a time: play wherever its schedule
+// falls in the frame, with the cycles in between left idle, then the frame's
+// sound and the pacer as for a cartridge. Without a display there are no
+// frames to skip or show. With audio slicing the frame goes a slice of
+// scanlines at a time instead, each synthesised and paced as it ends.
+void* gbs_main(void* arg) {
+	(void)arg;
+	int frames_run = 0;
+	int song = (gbs_track > 0 ? gbs_track : gbs.first_song) - 1;
+	printf("-GBS SONG: %d of %d-\n", song + 1, gbs.songs);
+
+	cpu_regs.af = cpu_regs.bc = cpu_regs.de = cpu_regs.hl = 0;
+	cpu_regs.a = song;
+	cpu_regs.sp = gbs.sp;
+	interrupt_master_enable = false;
+	cur_cycle_count = 0;
+	gbs_call(gbs.init, CLOCKSPEED);
+	u64 next_play = cycle_now();
+
+	while (atomic_load(&emulation_running)) {
+		u64 frame_start = platform_ticks();
+		u64 frame_end = atomic_load(&emulated_cycles) + (u64)SCREEN_REFRESH_CYCLES;
+		u64 slice_end = audio_slicing ? atomic_load(&emulated_cycles) + AUDIO_SLICE_CYCLES : frame_end;
+		for (;;) {
+			if (slice_end > frame_end) {
+				slice_end = frame_end;
+			}
+			while (next_play < slice_end) {
+				if (cycle_now() < next_play) {
+					cur_cycle_count = next_play - atomic_load(&emulated_cycles);
+				}
+				gbs_call(gbs.play, gbs.period);
+				next_play += gbs.period;
+			}
+			if (slice_end == frame_end) {
+				break;
+			}
+			if (cycle_now() < slice_end) {
+				cur_cycle_count = slice_end - atomic_load(&emulated_cycles);
+			}
+			audio_slice(1.0 - (frame_end - slice_end) / SCREEN_REFRESH_CYCLES);
+			slice_end += AUDIO_SLICE_CYCLES;
 		}
 
-		//frame_buffer[currentline+(SCREEN_HEIGHT/4)][pixel+(SCREEN_WIDTH/3)] = color_pallete[Tiles[tileNum][xPos % 8][yPos % 8]];
-
-		int baseX = pixel * scale;
-		for (int dx = 0; dx < scale; dx++) {
-			for (int dy = 0; dy < scale; dy++) {
-				frame_buffer[currentline * scale + dy][baseX + dx] = color_pallete[Tiles[tileNum][xPos % 8][yPos % 8]];
-			}
+		// A play call that ran over carries into the next frame.
+		u64 now = cycle_now();
+		atomic_store(&emulated_cycles, frame_end);
+		cur_cycle_count = now > frame_end ? now - frame_end : 0;
+
+		u64 synth_start = platform_ticks();
+		atomic_store(&frame_cpu_ticks, (long long)(synth_start - frame_start) - audio_pending_ticks - slice_wait_ticks);
+		audio_run(cycle_now());
+		audio_rate_update();
+		audio_pending_ticks += platform_ticks() - synth_start;
+		atomic_store(&frame_audio_ticks, audio_pending_ticks);
+		audio_pending_ticks = 0;
+		slice_wait_ticks = 0;
+
+		pacer_wait();
+		if (run_frames > 0 && ++frames_run >= run_frames) {
+			atomic_store(&emulation_running, false);
 		}
 	}
+	return NULL;
+}
 
-	// Draw windowed component
-	yPos = currentline - WindowY;
-	tileRow = yPos / 8 * 32;
-	for (; pixel < 160; pixel++) {
-		int xPos = scale * WindowX;
-		int tileColumn = (xPos / 8) % 32;
-		int tileNum;
-		if (unsig) {
-			tileNum = bus_read(window_address + tileRow + tileColumn);
-		}
-		else {
-			tileNum = (signed char)bus_read(window_address + tileRow + tileColumn) + 0x100;
-		}
+#pragma endregion
 
-		//frame_buffer[currentline][pixel] = color_pallete[Tiles[tileNum][xPos % 8][yPos % 8]];
-			
-		int baseX = pixel;
-		for (int dx = 0; dx < scale; dx++) {
-			for (int dy = 0; dy < scale; dy++) {
-			frame_buffer[currentline + dy * scale][baseX * scale + dx] = color_pallete[Tiles[tileNum][xPos % 8][yPos % 8]];
-		}
-		}
-		
+#pragma region Graphics and Gamepad
 
+// Output stage: runs once per frame, turning the native indexed frame into
+// colours and handing it to the selected scaler. Each line gets a 16 entry
+// table indexed by a pixel's layer and colour bits, built from the palettes
+// latched for that line, so palette changes mid-frame show where they were
+// made.
+void output_frame(const struct ppu_output* frame) {
+	for (int y = 0; y < 144; y++) {
+		const struct ppu_line_state* state = &frame->lines[y];
+		u32 line_lut[16];
+		memcpy(&line_lut[LAYER_BG], palette_lut[state->bgp], 4 * sizeof(u32));
+		memcpy(&line_lut[LAYER_WINDOW], palette_lut[state->bgp], 4 * sizeof(u32));
+		memcpy(&line_lut[LAYER_OBJ0], palette_lut[state->obp0], 4 * sizeof(u32));
+		memcpy(&line_lut[LAYER_OBJ1], palette_lut[state->obp1], 4 * sizeof(u32));
+
+		for (int x = 0; x < 160; x++) {
+			resolved_frame[y][x] = line_lut[frame->pixels[y][x] & (PIXEL_LAYER | PIXEL_COLOUR)];
+		}
+	}
 
+	// The scaler writes straight into the platform's frame.
+	int pitch;
+	u32* pixels = platform_lock_frame(&pitch);
+	scaler_run(scaler_filter, scale, &resolved_frame[0][0], 160, 144, 160, pixels, pitch);
+	if (show_hud) {
+		hud_draw(pixels, pitch, SCREEN_WIDTH, SCREEN_HEIGHT, &hud);
 	}
+	platform_unlock_frame();
 }
 
-void render_sprites() {
-	bool use8x16 = Bit_Test_no_flags(2, bus_read(0xFF40)) != 0; 
-
-	for (int sprite = 0; sprite < 40; sprite++) {
-		u8 index = sprite * 4;
-		u8 ypos = bus_read(0xFE00 + index) - 16;
-		u8 xpos = bus_read(0xFE00 + index + 1) - 8;
-		u8 address = bus_read(0xFE00 + index + 2);
-		u8 attributes = bus_read(0xFE00 + index + 3);
-
-		bool yflip = Bit_Test_no_flags(6, attributes);
-		bool xflip = Bit_Test_no_flags(5, attributes);
+void display_buffer() {
+	platform_present();
+}
 
-		if (ypos == 0 || xpos == 0 || ypos >= 160 || xpos >= 168) {
-			continue;
+// Native size, without the scaler or the overlay.
+bool save_screenshot(const char* path) {
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		printf("*Error in file opening: %s *\n", path);
+		return false;
+	}
+	fprintf(f, "P6\n160 144\n255\n");
+	for (int y = 0; y < 144; y++) {
+		for (int x = 0; x < 160; x++) {
+			u32 c = resolved_frame[y][x];
+			u8 rgb[3] = { c >> 16, c >> 8, c };
+			fwrite(rgb, 1, 3, f);
 		}
+	}
+	return fclose(f) == 0;
+}
 
-		for (int x = 0; x < 8; x++) {
-			for (int y = 0; y < 8; y++) {
-				if (Tiles[address][abs(8 * xflip - x)][abs(8 * yflip - y)]) {
-
-					for(int dx = 0; dx<scale; dx++){
-						for (int dy = 0; dy<scale; dy++){
-							frame_buffer[(((y*scale + (ypos*scale+dy)+SCREEN_HEIGHT)) % (SCREEN_HEIGHT))][((((xpos*scale+dx) + (x*scale)+SCREEN_WIDTH)) % (SCREEN_WIDTH))] =
-						color_pallete[Tiles[address][abs(8 * xflip - x)]
-						[abs(8 * yflip - y)]];
-						}
-					}
-					
-				}
+// Hands a finished frame to the presentation thread, then holds the
+// emulation to real time.
+void render_graphics(const struct ppu_output* frame) {
+	handoff_publish(frame);
+	pacer_wait();
+}
 
-				
-			}
+// The frame goes to the renderer, the last one it finished is shown. Frames
+// dropped by the frameskip are neither drawn nor shown, but still paced so
+// the emulation keeps to real time. Everything from the end of the last
+// wait up to here counts as CPU time, less any audio synthesis and pacing
+// between slices, finishing the frame as render time.
+void end_frame() {
+	static u64 frame_start;
+	static long long frame_start_instructions;
+	static int frames_run;
+	u64 vblank = platform_ticks();
+
+	bool skip = pacer_skip_frame();
+	const struct ppu_output* frame = ppu_end_frame(!skip);
+
+	if (frame_start) {
+		atomic_store(&frame_cpu_ticks, (long long)(vblank - frame_start) - audio_pending_ticks - slice_wait_ticks);
+	}
+	slice_wait_ticks = 0;
+	atomic_store(&frame_render_ticks, (long long)(platform_ticks() - vblank));
+
+	// Sound up to the VBlank, so rate control always measures the queue at
+	// the same point of the frame.
+	u64 synth_start = platform_ticks();
+	audio_run(cycle_now());
+	audio_rate_update();
+	audio_pending_ticks += platform_ticks() - synth_start;
+	atomic_store(&frame_audio_ticks, audio_pending_ticks);
+	audio_pending_ticks = 0;
+	atomic_store(&frame_instructions, instruction_count - frame_start_instructions);
+	frame_start_instructions = instruction_count;
+
+	if (skip) {
+		atomic_fetch_add(&frames_skipped, 1);
+		pacer_wait();
+	}
+	else {
+		render_graphics(frame);
+	}
+	frame_start = platform_ticks();
 
-		}
+	if (run_frames > 0 && ++frames_run >= run_frames) {
+		atomic_store(&emulation_running, false);
 	}
 }
 
-// Copies frame_buffer to texture. Copies texture to renderer and then displays it.
-void display_buffer() {
-	SDL_UpdateTexture(texture, NULL, frame_buffer, SCREEN_WIDTH * sizeof(u8) * 3);
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, NULL, NULL);
-	SDL_RenderPresent(renderer);
+// Frame and emulation rates are averaged over half a second, the phase
+// times are the latest.
+void update_hud(long long present_ticks) {
+	static u64 window_start;
+	static long long window_cycles;
+	static int window_frames;
+	u64 now = platform_ticks();
+	double tick_ms = 1000.0 / platform_tick_rate();
+
+	if (window_start == 0) {
+		window_start = now;
+		window_cycles = atomic_load(&emulated_cycles);
+	}
+	window_frames++;
+	double elapsed_ms = (now - window_start) * tick_ms;
+	if (elapsed_ms >= 500) {
+		long long cycles = atomic_load(&emulated_cycles);
+		hud.fps = window_frames * 1000.0 / elapsed_ms;
+		hud.speed = (cycles - window_cycles) * 100.0 / (DMG_CLOCK_FREQ * elapsed_ms / 1000.0);
+		window_start = now;
+		window_cycles = cycles;
+		window_frames = 0;
+	}
+
+	hud.instructions = atomic_load(&frame_instructions);
+	hud.frame_ms = 1000.0 / VERTICAL_SYNC;
+	hud.cpu_ms = atomic_load(&frame_cpu_ticks) * tick_ms;
+	hud.render_ms = atomic_load(&frame_render_ticks) * tick_ms;
+	hud.present_ms = present_ticks * tick_ms;
+	hud.audio_ms = atomic_load(&frame_audio_ticks) * tick_ms;
+	hud.skipped = atomic_load(&frames_skipped);
+	hud.audio_fill = (double)audio_buffered() / AUDIO_RING_FRAMES;
+
+	struct audio_stats audio;
+	audio_get_stats(&audio);
+	hud.audio_latency_ms = audio.latency_ms;
+	hud.audio_drift_ppm = audio.drift_ppm;
+	hud.audio_underruns = audio.underruns;
+	hud.audio_overruns = audio.overruns;
 }
 
-// Renders the graphics once per frame.
-void render_graphics() {
-	SDL_Delay(10);
-	setup_color_pallete();
-	load_tiles();
-	render_sprites();
-	display_buffer();
+// Sound up to now, then wait for the part of the frame it ends to be due,
+// so the ring only ever needs a slice of audio ahead of the device.
+void audio_slice(double done) {
+	u64 synth_start = platform_ticks();
+	audio_run(cycle_now());
+	u64 wait_start = platform_ticks();
+	audio_pending_ticks += wait_start - synth_start;
+	pacer_wait_part(done);
+	slice_wait_ticks += platform_ticks() - wait_start;
 }
 
 void increment_scan_line() {
@@ -1271,14 +1756,12 @@ void increment_scan_line() {
 	}
 
 	if (scanline_count <= 0) {
-		// Render tilemap line if scanline is completed.
-		render_tile_map_line();
 		ram[0xFF44]++;
 		scanline_count = 456;
 		// Check if all lines are finished and if so do a VBLANK.
 		if (bus_read(0xFF44) == 144)  
 		{
-			render_graphics();
+			end_frame();
 			enable_interrupt(0);
 		}
 		// Reset scanline once it reaches the end.
@@ -1286,6 +1769,11 @@ void increment_scan_line() {
 		{
 			ram[0xFF44] = 0;
 		}
+		// Lines count from the VBlank, where the frame's deadline falls.
+		u8 line = bus_read(0xFF44);
+		if (audio_slicing && line != 144 && line % AUDIO_SLICE_LINES == 0) {
+			audio_slice(((line + 154 - 144) % 154) / 154.0);
+		}
 	}
 }
 
@@ -1354,87 +1842,46 @@ void set_lcd_status() {
 	bus_write(status, 0xFF41);
 }
 
+// Joypad keys are numbered as their joypad bits, the rest act here or
+// become their own events.
 void handle_input() {
-	
-	if (event.type == SDL_KEYDOWN) {
-		int key = -1;
-		switch (event.key.keysym.sym) {
-		case SDLK_TAB:
-			key = 4; //A
+	if (event.kind == EVENT_KEY_DOWN) {
+		switch (event.key) {
+		case KEY_RESET:
+			input_push((struct input_event) { INPUT_RESET, 0 });
 			break;
-		case SDLK_LCTRL:
-			key = 5; //B
+		case KEY_HUD:
+			show_hud = !show_hud;
 			break;
-		case SDLK_RETURN:
-			key = 7; //Start
+		case KEY_QUIT:
+			atomic_store(&emulation_running, false);
 			break;
-		case SDLK_BACKSLASH:
-			key = 6; //Select
-			break;
-		case SDLK_RIGHT:
-			key = 0; //R
-			break;
-		case SDLK_LEFT: 
-			key = 1; //L
-			break;
-		case SDLK_UP:
-			key = 2; //U
-			break;
-		case SDLK_DOWN:
-			key = 3; //D
-			break;
-		
-		case SDLK_m:
-			cpu_regs.pc = 0;
-			break;
-
-		case SDLK_ESCAPE:
-			shutdown_emu();
 		default:
-			key = -1;
+			input_push((struct input_event) { INPUT_PRESS, event.key });
 			break;
 		}
-
-		if (key != -1) {
-			key_press(key);
-		}
 	}
-	else if (event.type == SDL_KEYUP) {
-		int key = -1;
+	else if (event.kind == EVENT_KEY_UP && event.key <= KEY_START) {
+		input_push((struct input_event) { INPUT_RELEASE, event.key });
+	}
+}
 
-		switch (event.key.keysym.sym) {
-		case SDLK_TAB:
-			key = 4;
-			break;
-		case SDLK_LCTRL:
-			key = 5;
-			break;
-		case SDLK_RETURN:
-			key = 7;
-			break;
-		case SDLK_BACKSLASH:
-			key = 6;
-			break;
-		case SDLK_RIGHT:
-			key = 0;
-			break;
-		case SDLK_LEFT:
-			key = 1;
-			break;
-		case SDLK_UP:
-			key = 2;
+// Input events from the presentation thread, applied between instructions
+// so the joypad state and its interrupt stay on the emulation thread.
+void apply_input() {
+	struct input_event input;
+	while (input_pop(&input)) {
+		switch (input.kind) {
+		case INPUT_PRESS:
+			key_press(input.key);
 			break;
-		case SDLK_DOWN:
-			key = 3;
+		case INPUT_RELEASE:
+			key_release(input.key);
 			break;
-		default:
-			key = -1;
+		case INPUT_RESET:
+			cpu_regs.pc = 0;
 			break;
 		}
-
-		if (key != -1) {
-			key_release(key);
-		}
 	}
 }
 
@@ -1470,14 +1917,14 @@ u8 controller_reg_state() {
 
 	// Are we interested in the standard buttons?
 	if (!Bit_Test_no_flags(4, res)) {
-		BYTE topJoypad = controller_state >> 4;
+		u8 topJoypad = controller_state >> 4;
 		topJoypad |= 0xF0;  // turn the top 4 bits on
 		res &= topJoypad;   // show what buttons are pressed
 	}
 	// Or directional buttons?
 	else if (!Bit_Test_no_flags(5, res))  // directional buttons
 	{
-		BYTE bottomJoypad = controller_state & 0xF;
+		u8 bottomJoypad = controller_state & 0xF;
 		bottomJoypad |= 0xF0;
 		res &= bottomJoypad;
 	}
@@ -1489,56 +1936,25 @@ u8 controller_reg_state() {
 #pragma region Startup and Shutdown
 
 void init_HAL() {
-	SDL_Init(SDL_INIT_VIDEO);
-	SDL_Init(SDL_INIT_AUDIO);
-	SDL_CreateWindowAndRenderer(SCREEN_WIDTH, SCREEN_HEIGHT, 0, &window,
-		&renderer);
-	logo = SDL_LoadBMP("projectLogo.bmp");
-	SDL_SetWindowIcon(window, logo);
-	
-	//SDL_RenderSetLogicalSize(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24,
-		SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH,
-		SCREEN_HEIGHT);
-	SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-	SDL_RenderClear(renderer);
-	SDL_RenderPresent(renderer);
+	if (!platform_init("OneFileGBEMU", SCREEN_WIDTH, SCREEN_HEIGHT, vsync)) {
+		exit(EXIT_FAILURE);
+	}
 }
 
-void setup_color_pallete() {
-	u8 color;
-	for (int i = 0; i < 4; i++) {
-		color = ((0x3 << 2 * i) & ram[0xFF47]) >> 2 * i;
-		switch (color) {
-		case (0x0):
-			color_pallete[i].r = 255;
-			color_pallete[i].g = 255;
-			color_pallete[i].b = 255;
-			break;
-		case (0x1):
-			color_pallete[i].r = 180;
-			color_pallete[i].g = 180;
-			color_pallete[i].b = 180;
-			break;
-		case (0x2):
-			color_pallete[i].r = 110;
-			color_pallete[i].g = 110;
-			color_pallete[i].b = 110;
-			break;
-		case (0x3):
-			color_pallete[i].r = 0;
-			color_pallete[i].g = 0;
-			color_pallete[i].b = 0;
-			break;
+// Colour i of a palette is bits 2i+1..2i of the register.
+void setup_palette_luts() {
+	for (int value = 0; value < 256; value++) {
+		for (int i = 0; i < 4; i++) {
+			palette_lut[value][i] = shades[(value >> (2 * i)) & 0x3];
 		}
 	}
 }
 
-void shutdown_emu() {
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
-	SDL_Quit();
-	exit(1);
+void shutdown_emu(int status) {
+	ppu_shutdown();
+	scaler_shutdown();
+	platform_shutdown();
+	exit(status);
 }
 
 #pragma endregion
@@ -1650,6 +2066,11 @@ void enable_interrupt(u8 interrupt_type){
     //there's a few rundant things here if you ask me, the bus_write would be unnecessary if the set function would've actually modified the value
 }
 
+// The batches run so far plus the current one's progress.
+u64 cycle_now() {
+	return atomic_load_explicit(&emulated_cycles, memory_order_relaxed) + cur_cycle_count;
+}
+
 void update_timers() {
 	// Update Divider Register
 	u8 timer_control = bus_read(0xFF07);
@@ -0,0 +1,204 @@
+/**
+ * Frame pacing (see pacer.h).
+ */
+
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "pacer.h"
+
+// The pacer sleeps until the deadline less the spin, then spins the rest of
+// the way so scheduler wake-up latency doesn't show as jitter. The spin
+// follows the worst recent oversleep, decaying by 1/SPIN_DECAY a frame, so
+// it stays around a tenth of a millisecond where sleeps are accurate.
+#define SPIN_MIN_NS 100000LL
+#define SPIN_MAX_NS 4000000LL
+#define SPIN_MARGIN_NS 50000LL
+#define SPIN_DECAY 16
+
+static struct {
+	int64_t period;      // ns per frame
+	int64_t deadline;    // When the current frame is due
+	int64_t last;        // When pacer_wait() last returned
+	bool unpaced;        // Only measure, never sleep
+	double lag;
+	int max_skip;        // Consecutive frames frameskip may drop, 0 is off
+	int skip_run;
+	int64_t spin;        // ns before the deadline to stop sleeping
+} pace;
+
+// Running statistics, Welford's method for the variance.
+static struct {
+	u64 frames;
+	u64 late;
+	double mean;
+	double m2;
+	double min;
+	double max;
+	u64 skipped;
+} welford;
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(int64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
+	nanosleep(&ts, NULL);
+}
+
+#ifdef _WIN32
+static void restore_timer(void) {
+	timeEndPeriod(1);
+}
+#endif
+
+// Windows rounds sleeps up to its timer tick, 15.6 ms unless asked for 1.
+static void fine_timer(void) {
+#ifdef _WIN32
+	static bool done;
+	if (!done && timeBeginPeriod(1) == TIMERR_NOERROR) {
+		atexit(restore_timer);
+	}
+	done = true;
+#endif
+}
+
+// Sleep until "wake", then spin to "deadline", learning the oversleep.
+static int64_t sleep_until(int64_t wake, int64_t deadline) {
+	int64_t now = now_ns();
+	if (now < wake) {
+		sleep_ns(wake - now);
+		now = now_ns();
+		int64_t over = now - wake + SPIN_MARGIN_NS;
+		pace.spin -= pace.spin / SPIN_DECAY;
+		if (over > pace.spin) {
+			pace.spin = over < SPIN_MAX_NS ? over : SPIN_MAX_NS;
+		}
+		if (pace.spin < SPIN_MIN_NS) {
+			pace.spin = SPIN_MIN_NS;
+		}
+	}
+	while (now < deadline) {
+		now = now_ns();
+	}
+	return now;
+}
+
+static void record(int64_t interval) {
+	double ms = interval / 1e6;
+	welford.frames++;
+	double delta = ms - welford.mean;
+	welford.mean += delta / welford.frames;
+	welford.m2 += delta * (ms - welford.mean);
+	if (welford.frames == 1 || ms < welford.min) {
+		welford.min = ms;
+	}
+	if (ms > welford.max) {
+		welford.max = ms;
+	}
+}
+
+void pacer_init(double hz, bool unpaced) {
+	pace.period = (int64_t)(1e9 / hz);
+	pace.unpaced = unpaced;
+	pace.spin = SPIN_MIN_NS;
+	fine_timer();
+	pace.last = now_ns();
+	pace.deadline = pace.last + pace.period;
+	pace.lag = 0;
+	pacer_reset_stats();
+}
+
+void pacer_wait(void) {
+	int64_t now = now_ns();
+	int64_t behind = now - pace.deadline;
+
+	pace.lag = behind > 0 ? (double)behind / pace.period : 0;
+	if (behind > 0) {
+		welford.late++;
+	}
+
+	if (!pace.unpaced) {
+		now = sleep_until(pace.deadline - pace.spin, pace.deadline);
+	}
+	else {
+		now = now_ns();
+	}
+
+	record(now - pace.last);
+	pace.last = now;
+
+	// Late by more than a frame: start over from now rather than running
+	// a burst of unpaced frames to catch up.
+	pace.deadline += pace.period;
+	if (pace.deadline < now) {
+		pace.deadline = now + pace.period;
+	}
+}
+
+void pacer_wait_part(double done) {
+	if (pace.unpaced) {
+		return;
+	}
+	// Early by the usual oversleep, as a slice running late costs more
+	// than one starting early.
+	int64_t wake = pace.deadline - pace.period + (int64_t)(done * pace.period) - pace.spin;
+	int64_t now = now_ns();
+	if (now < wake) {
+		sleep_ns(wake - now);
+	}
+}
+
+double pacer_lag(void) {
+	return pace.lag;
+}
+
+void pacer_set_frameskip(int max) {
+	pace.max_skip = max < 0 ? 0 : max;
+	pace.skip_run = 0;
+}
+
+bool pacer_skip_frame(void) {
+	if (pace.skip_run < pace.max_skip && now_ns() > pace.deadline) {
+		pace.skip_run++;
+		welford.skipped++;
+		return true;
+	}
+	pace.skip_run = 0;
+	return false;
+}
+
+void pacer_get_stats(struct pacer_stats *stats) {
+	stats->frames = welford.frames;
+	stats->late = welford.late;
+	stats->mean_ms = welford.mean;
+	stats->min_ms = welford.min;
+	stats->max_ms = welford.max;
+	stats->jitter_ms = welford.frames > 1 ? sqrt(welford.m2 / (welford.frames - 1)) : 0;
+	stats->skipped = welford.skipped;
+}
+
+void pacer_reset_stats(void) {
+	welford.frames = 0;
+	welford.late = 0;
+	welford.mean = 0;
+	welford.m2 = 0;
+	welford.min = 0;
+	welford.max = 0;
+	welford.skipped = 0;
+}
+
+void pacer_print_stats(void) {
+	struct pacer_stats s;
+	pacer_get_stats(&s);
+	printf("Frames: %llu, late %llu, skipped %llu, frame time %.3f ms (min %.3f, max %.3f, jitter %.3f)\n",
+		(unsigned long long)s.frames, (unsigned long long)s.late, (unsigned long long)s.skipped,
+		s.mean_ms, s.min_ms, s.max_ms, s.jitter_ms);
+}
@@ -0,0 +1,68 @@
+/**
+ * Frame pacing.
+ * Holds the emulator to a target frame rate on the host's monotonic clock.
+ * Every frame has a deadline one period after the last; the pacer sleeps
+ * until shortly before it and spins the rest of the way. Unpaced, for runs
+ * with no real time to keep to, it only measures. With frameskip on, frames running late are not drawn, so the emulation
+ * itself keeps real-time speed when the host can't keep up.
+ */
+
+#pragma once
+
+#include "qol.h"
+
+struct pacer_stats {
+	u64 frames;          // Frames paced since the last reset
+	u64 late;            // Frames that reached the pacer after their deadline
+	double mean_ms;      // Mean time between frames
+	double min_ms;
+	double max_ms;
+	double jitter_ms;    // Standard deviation of the time between frames
+	u64 skipped;         // Frames not drawn by the frameskip
+};
+
+/**
+ * Start pacing at "hz" frames per second. With "unpaced" the pacer only
+ * measures and never sleeps.
+ */
+void pacer_init(double hz, bool unpaced);
+
+/**
+ * Block until the current frame's deadline, then move it on by one period.
+ * A frame that arrives more than a period late restarts the schedule from
+ * now instead of rushing to catch up.
+ */
+void pacer_wait(void);
+
+/**
+ * Block until "done" (0 to 1) of the current frame's period has passed, for
+ * callers that run a frame in slices. Only sleeps, and leaves the deadline
+ * and the statistics to pacer_wait(). Returns at once when unpaced.
+ */
+void pacer_wait_part(double done);
+
+/**
+ * How far behind its deadline the last frame reached pacer_wait(), in
+ * frames. 0 when it was on time.
+ */
+double pacer_lag(void);
+
+/**
+ * Allow up to "max" frames in a row to be skipped while behind, 0 turns
+ * frameskip off.
+ */
+void pacer_set_frameskip(int max);
+
+/**
+ * Decide whether the frame about to be shown is skipped: it is when it is
+ * already past its deadline, for at most the frameskip's maximum in a row.
+ */
+bool pacer_skip_frame(void);
+
+void pacer_get_stats(struct pacer_stats *stats);
+void pacer_reset_stats(void);
+
+/**
+ * Print the statistics on one line.
+ */
+void pacer_print_stats(void);
@@ -0,0 +1,103 @@
+/**
+ * Platform layer.
+ * Everything the emulator needs from the host beyond the C library and
+ * pthreads: somewhere to show frames, an audio device, input and a clock.
+ * platform_sdl.c implements it with SDL2 for the desktop. platform_headless.c
+ * keeps frames and audio in memory and opens no display or audio device, so
+ * the core builds and runs on servers with nothing but a C compiler.
+ */
+
+#pragma once
+
+#include "qol.h"
+
+// Joypad keys are numbered as their bits in the joypad state.
+enum platform_key {
+	KEY_RIGHT,
+	KEY_LEFT,
+	KEY_UP,
+	KEY_DOWN,
+	KEY_A,
+	KEY_B,
+	KEY_SELECT,
+	KEY_START,
+	KEY_RESET,   // Jump back to 0x0000
+	KEY_HUD,     // Toggle the performance overlay
+	KEY_QUIT
+};
+
+enum platform_event_kind {
+	EVENT_QUIT,
+	EVENT_KEY_DOWN,
+	EVENT_KEY_UP
+};
+
+struct platform_event {
+	int kind;
+	int key;    // enum platform_key, for key events
+};
+
+typedef void (*platform_audio_callback)(void *userdata, u8 *stream, int len);
+
+/**
+ * Open a "width" x "height" XRGB8888 output called "title". With "vsync"
+ * presents wait for the display. Returns false on failure.
+ */
+bool platform_init(const char *title, int width, int height, bool vsync);
+
+void platform_shutdown(void);
+
+/**
+ * The image the next present shows, for the caller to draw in. "pitch" gets
+ * the distance between rows in pixels. Must be followed by
+ * platform_unlock_frame() before presenting.
+ */
+u32 *platform_lock_frame(int *pitch);
+void platform_unlock_frame(void);
+
+void platform_present(void);
+
+/**
+ * Start audio output: stereo, 32-bit float samples at "rate" Hz, with
+ * "callback" asked for "samples" frames at a time on a thread of the
+ * platform's. The rate and buffer size actually used are stored in
+ * "got_rate" and "got_samples": the rate is the device's own if it runs at
+ * another, nothing is converted on the way. Returns false on failure.
+ */
+bool platform_open_audio(int rate, int samples, platform_audio_callback callback,
+	int *got_rate, int *got_samples);
+
+/**
+ * Take the next pending input event. Returns false when there is none.
+ */
+bool platform_poll_event(struct platform_event *event);
+
+/**
+ * Monotonic clock, in ticks of platform_tick_rate() per second.
+ */
+u64 platform_ticks(void);
+u64 platform_tick_rate(void);
+
+void platform_sleep_ms(int ms);
+
+int platform_cpu_count(void);
+
+#pragma region Headless
+
+/**
+ * platform_headless.c only, safe from any thread. Copies the last presented
+ * frame into "to" (width * height pixels, or NULL for just the size) and
+ * returns how many frames have been presented, so a caller polling it can
+ * tell a new frame from the one it already has.
+ */
+u64 headless_frame(u32 *to, int *width, int *height);
+
+/**
+ * platform_headless.c only, safe from any thread. Takes up to "frames" of the
+ * oldest stereo frames not yet taken into "to", interleaved, and returns how
+ * many there were. The ring holds one second at the device's rate; a caller
+ * that falls further behind loses the oldest.
+ */
+unsigned headless_audio(float *to, unsigned frames);
+
+#pragma endregion
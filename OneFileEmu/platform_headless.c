@@ -0,0 +1,199 @@
+/**
+ * Headless platform layer (see platform.h).
+ * Frames are drawn into memory and audio is pulled from the callback at the
+ * device's pace by a thread of our own, into a one second ring. Both are
+ * read through the headless_* calls. There is no input, so a run ends when
+ * the emulator stops itself.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+// Drawn into, and the last one presented. The lock covers swapping them
+// and reading the presented one.
+static struct {
+	u32 *buffers[2];
+	int drawing;
+	int width;
+	int height;
+	u64 presented;      // Frames presented since the start
+	pthread_mutex_t lock;
+} frame;
+
+static struct {
+	pthread_t thread;
+	bool running;
+	platform_audio_callback callback;
+	int rate;
+	int samples;
+	float *buffer;      // One callback's worth
+	float *ring;        // One second, stereo interleaved
+	u64 written;        // Stereo frames written since the start
+	u64 read;           // Stereo frames taken by headless_audio()
+	pthread_mutex_t lock;
+} audio;
+
+bool platform_init(const char *title, int width, int height, bool vsync) {
+	(void)vsync;
+	printf("%s: headless, %dx%d frames in memory\n", title, width, height);
+	frame.width = width;
+	frame.height = height;
+	frame.buffers[0] = calloc((size_t)width * height, sizeof(u32));
+	frame.buffers[1] = calloc((size_t)width * height, sizeof(u32));
+	pthread_mutex_init(&frame.lock, NULL);
+	return frame.buffers[0] && frame.buffers[1];
+}
+
+void platform_shutdown(void) {
+	if (audio.callback) {
+		pthread_mutex_lock(&audio.lock);
+		audio.running = false;
+		pthread_mutex_unlock(&audio.lock);
+		pthread_join(audio.thread, NULL);
+		free(audio.buffer);
+		free(audio.ring);
+	}
+	free(frame.buffers[0]);
+	free(frame.buffers[1]);
+}
+
+u32 *platform_lock_frame(int *pitch) {
+	*pitch = frame.width;
+	return frame.buffers[frame.drawing];
+}
+
+void platform_unlock_frame(void) {
+}
+
+void platform_present(void) {
+	pthread_mutex_lock(&frame.lock);
+	frame.drawing ^= 1;
+	frame.presented++;
+	pthread_mutex_unlock(&frame.lock);
+}
+
+u64 headless_frame(u32 *to, int *width, int *height) {
+	pthread_mutex_lock(&frame.lock);
+	*width = frame.width;
+	*height = frame.height;
+	if (to) {
+		memcpy(to, frame.buffers[frame.drawing ^ 1], (size_t)frame.width * frame.height * sizeof(u32));
+	}
+	u64 presented = frame.presented;
+	pthread_mutex_unlock(&frame.lock);
+	return presented;
+}
+
+#pragma region Audio
+
+static void add_ns(struct timespec *ts, long ns) {
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+// Asks for a buffer every buffer period, like a device would, on an
+// absolute schedule so the pace doesn't drift.
+static void *audio_main(void *arg) {
+	(void)arg;
+	long period = (long)((double)audio.samples * 1000000000.0 / audio.rate);
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (;;) {
+		pthread_mutex_lock(&audio.lock);
+		bool running = audio.running;
+		pthread_mutex_unlock(&audio.lock);
+		if (!running) {
+			break;
+		}
+
+		audio.callback(NULL, (u8 *)audio.buffer, audio.samples * 2 * sizeof(float));
+
+		// A full ring loses its oldest frames.
+		pthread_mutex_lock(&audio.lock);
+		for (int i = 0; i < audio.samples; i++) {
+			size_t at = (size_t)((audio.written + i) % audio.rate) * 2;
+			audio.ring[at + 0] = audio.buffer[i * 2 + 0];
+			audio.ring[at + 1] = audio.buffer[i * 2 + 1];
+		}
+		audio.written += audio.samples;
+		if (audio.written - audio.read > (u64)audio.rate) {
+			audio.read = audio.written - audio.rate;
+		}
+		pthread_mutex_unlock(&audio.lock);
+
+		add_ns(&next, period);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+bool platform_open_audio(int rate, int samples, platform_audio_callback callback,
+	int *got_rate, int *got_samples) {
+	audio.rate = rate;
+	audio.samples = samples;
+	audio.callback = callback;
+	audio.buffer = malloc((size_t)samples * 2 * sizeof(float));
+	audio.ring = calloc((size_t)rate * 2, sizeof(float));
+	audio.running = true;
+	pthread_mutex_init(&audio.lock, NULL);
+	if (!audio.buffer || !audio.ring || pthread_create(&audio.thread, NULL, audio_main, NULL) != 0) {
+		printf("Could not start headless audio\n");
+		audio.callback = NULL;
+		return false;
+	}
+	*got_rate = rate;
+	*got_samples = samples;
+	return true;
+}
+
+unsigned headless_audio(float *to, unsigned frames) {
+	pthread_mutex_lock(&audio.lock);
+	unsigned taken = 0;
+	if (audio.ring) {
+		u64 pending = audio.written - audio.read;
+		taken = pending < frames ? (unsigned)pending : frames;
+		for (unsigned i = 0; i < taken; i++) {
+			size_t at = (size_t)((audio.read + i) % audio.rate) * 2;
+			to[i * 2 + 0] = audio.ring[at + 0];
+			to[i * 2 + 1] = audio.ring[at + 1];
+		}
+		audio.read += taken;
+	}
+	pthread_mutex_unlock(&audio.lock);
+	return taken;
+}
+
+#pragma endregion
+
+bool platform_poll_event(struct platform_event *event) {
+	(void)event;
+	return false;
+}
+
+u64 platform_ticks(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+u64 platform_tick_rate(void) {
+	return 1000000000ULL;
+}
+
+void platform_sleep_ms(int ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+int platform_cpu_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
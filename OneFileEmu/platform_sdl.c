@@ -0,0 +1,165 @@
+/**
+ * SDL2 platform layer (see platform.h).
+ */
+
+#define SDL_MAIN_HANDLED
+#include <SDL2/SDL.h>
+
+#include "platform.h"
+
+static SDL_Window *window;
+static SDL_Renderer *renderer;
+static SDL_Texture *texture;
+static SDL_Surface *logo;
+static SDL_AudioDeviceID audio_dev;
+
+// Only used when the texture can't be locked: the frame is drawn here and
+// uploaded on unlock.
+static u32 *staging;
+static bool staged;
+static int frame_width;
+static int frame_height;
+
+bool platform_init(const char *title, int width, int height, bool vsync) {
+	SDL_SetMainReady();
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0) {
+		printf("SDL could not start: %s\n", SDL_GetError());
+		return false;
+	}
+	frame_width = width;
+	frame_height = height;
+	window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+		width, height, 0);
+	renderer = SDL_CreateRenderer(window, -1, vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+	logo = SDL_LoadBMP("projectLogo.bmp");
+	SDL_SetWindowIcon(window, logo);
+
+	staging = malloc((size_t)width * height * sizeof(u32));
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_XRGB8888,
+		SDL_TEXTUREACCESS_STREAMING, width, height);
+	SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+	SDL_RenderClear(renderer);
+	SDL_RenderPresent(renderer);
+	return window && renderer && texture && staging;
+}
+
+void platform_shutdown(void) {
+	if (audio_dev) {
+		SDL_CloseAudioDevice(audio_dev);
+	}
+	free(staging);
+	SDL_DestroyTexture(texture);
+	SDL_DestroyRenderer(renderer);
+	SDL_DestroyWindow(window);
+	SDL_FreeSurface(logo);
+	SDL_Quit();
+}
+
+// The caller draws straight into the locked texture. Only if the texture
+// can't be locked does it go through the staging buffer and an upload.
+u32 *platform_lock_frame(int *pitch) {
+	void *pixels;
+	int bytes;
+	if (SDL_LockTexture(texture, NULL, &pixels, &bytes) == 0) {
+		staged = false;
+		*pitch = bytes / sizeof(u32);
+		return pixels;
+	}
+	staged = true;
+	*pitch = frame_width;
+	return staging;
+}
+
+void platform_unlock_frame(void) {
+	if (staged) {
+		SDL_UpdateTexture(texture, NULL, staging, frame_width * sizeof(u32));
+	}
+	else {
+		SDL_UnlockTexture(texture);
+	}
+}
+
+void platform_present(void) {
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
+
+bool platform_open_audio(int rate, int samples, platform_audio_callback callback,
+	int *got_rate, int *got_samples) {
+	SDL_AudioSpec want, have;
+
+	SDL_zero(want);
+	want.freq = rate;
+	want.format = AUDIO_F32SYS;
+	want.channels = 2;
+	want.samples = samples;
+	want.callback = callback;
+	want.userdata = NULL;
+
+	printf("Audio driver: %s\n", SDL_GetAudioDeviceName(0, 0));
+
+	// The device keeps its own rate, the emulator resamples to it rather
+	// than SDL.
+	if ((audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+		SDL_AUDIO_ALLOW_FREQUENCY_CHANGE)) == 0) {
+		printf("SDL could not open audio device: %s\n", SDL_GetError());
+		return false;
+	}
+	*got_rate = have.freq;
+	*got_samples = have.samples;
+	SDL_PauseAudioDevice(audio_dev, 0);
+	return true;
+}
+
+static int translate_key(SDL_Keycode sym) {
+	switch (sym) {
+	case SDLK_TAB:       return KEY_A;
+	case SDLK_LCTRL:     return KEY_B;
+	case SDLK_RETURN:    return KEY_START;
+	case SDLK_BACKSLASH: return KEY_SELECT;
+	case SDLK_RIGHT:     return KEY_RIGHT;
+	case SDLK_LEFT:      return KEY_LEFT;
+	case SDLK_UP:        return KEY_UP;
+	case SDLK_DOWN:      return KEY_DOWN;
+	case SDLK_m:         return KEY_RESET;
+	case SDLK_h:         return KEY_HUD;
+	case SDLK_ESCAPE:    return KEY_QUIT;
+	default:             return -1;
+	}
+}
+
+bool platform_poll_event(struct platform_event *event) {
+	SDL_Event e;
+	while (SDL_PollEvent(&e)) {
+		if (e.type == SDL_QUIT) {
+			event->kind = EVENT_QUIT;
+			return true;
+		}
+		if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+			int key = translate_key(e.key.keysym.sym);
+			if (key >= 0) {
+				event->kind = e.type == SDL_KEYDOWN ? EVENT_KEY_DOWN : EVENT_KEY_UP;
+				event->key = key;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+u64 platform_ticks(void) {
+	return SDL_GetPerformanceCounter();
+}
+
+u64 platform_tick_rate(void) {
+	return SDL_GetPerformanceFrequency();
+}
+
+void platform_sleep_ms(int ms) {
+	SDL_Delay(ms);
+}
+
+int platform_cpu_count(void) {
+	return SDL_GetCPUCount();
+}
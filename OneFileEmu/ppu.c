@@ -0,0 +1,700 @@
+/**
+ * Scanline renderer (see ppu.h).
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ppu.h"
+#include "ppu_simd.h"
+
+#define BIT(n, value) (((value) >> (n)) & 1)
+
+#define PPU_MAX_THREADS 8
+
+// Past this many entries the journal is applied on the spot instead of
+// growing further. A frame with the LCD on ends long before that, so only
+// a long stretch with it off gets here; see ppu_write().
+#define JOURNAL_FLUSH_SIZE (1 << 20)
+
+struct ppu_write {
+	u16 address;
+	u8 value;
+	u8 line;
+};
+
+struct journal {
+	struct ppu_write *entries;
+	int count;
+	int size;
+};
+
+// The renderer's copy of memory. Only VRAM, OAM and 0xFF40-0xFF4B are used;
+// a full address space keeps the addresses the same as the CPU side.
+static u8 mem[0x10000];
+
+static u8 Tiles[384][8][8];   // Decoded tile store, Tiles[tile][y][x] holds a colour index.
+static bool tile_dirty[384];  // Tiles whose VRAM bytes changed since the last load_tiles().
+static int tiles_dirty_count = 0;
+
+// Both tile maps kept fully decoded, map_bitmap[0] for 0x9800 and [1] for
+// 0x9C00, one colour index per pixel. A cell is redrawn only once its map byte
+// or its tile changes; map_cell_dirty is indexed like the maps in VRAM.
+static u8 map_bitmap[2][256][256];
+static bool map_cell_dirty[2048];
+static int map_cells_dirty_count = 0;
+static bool map_unsigned = true;   // LCDC bit 4 the bitmaps were drawn with.
+
+// Sprite index: for each line, the sprites the PPU selects there and the tile
+// row each one shows. Only rebuilt after OAM or the sprite height changes.
+struct line_sprite {
+	u8 x;           // OAM X, screen X + 8
+	u8 tile;        // Tile on this line, 8x16 halves already resolved
+	u8 row;         // Row of that tile, after Y flip
+	u8 attributes;
+};
+static struct line_sprite line_sprites[144][10];
+static u8 line_sprite_count[144];
+static bool oam_dirty = true;
+static int sprite_index_height = 0;
+
+// Replay position within the frame being drawn.
+static int lines_rendered = 0;
+static int window_line;       // Internal window line counter.
+
+// Two frames: one being drawn, one finished and handed to the output stage.
+static struct ppu_output frames[2];
+static struct ppu_output *drawing = &frames[0];
+static struct ppu_output *finished = &frames[1];
+
+// The CPU fills one journal while the renderer replays the other.
+static struct journal journals[2];
+static struct journal *filling = &journals[0];
+static struct journal *replaying = &journals[1];
+
+static struct {
+	pthread_t render;
+	pthread_t helpers[PPU_MAX_THREADS];
+	int helper_count;
+	bool threaded;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;          // A frame was queued
+	pthread_cond_t idle;          // The queued frame is drawn
+	pthread_cond_t band_wake;
+	pthread_cond_t band_done;
+	bool queued;
+	bool draw;                    // The queued frame is drawn, not just applied
+	unsigned band_generation;
+	int bands_busy;
+	bool quit;
+} pool;
+
+#pragma region Caches
+
+static void mark_map_cell(int cell) {
+	if (!map_cell_dirty[cell]) {
+		map_cell_dirty[cell] = true;
+		map_cells_dirty_count++;
+	}
+}
+
+// Decodes every tile written since the last call, handing runs of neighbouring
+// tiles to the kernel in one go.
+static void load_tiles(void) {
+	if (tiles_dirty_count == 0) {
+		return;
+	}
+
+	int s = 0;
+	while (s < 384) {
+		if (!tile_dirty[s]) {
+			s++;
+			continue;
+		}
+
+		int end = s;
+		while (end < 384 && tile_dirty[end]) {
+			end++;
+		}
+		decode_tiles(&mem[0x8000 + 16 * s], &Tiles[s][0][0], end - s);
+		s = end;
+	}
+
+	// One pass over both maps for the whole batch: every cell showing one of
+	// the changed tiles gets redrawn.
+	for (int cell = 0; cell < 2048; cell++) {
+		u8 index = mem[0x9800 + cell];
+		int tile = map_unsigned ? index : (signed char)index + 0x100;
+		if (tile_dirty[tile]) {
+			mark_map_cell(cell);
+		}
+	}
+
+	memset(tile_dirty, 0, sizeof(tile_dirty));
+	tiles_dirty_count = 0;
+}
+
+// Redraws the dirty cells of both map bitmaps. A change of the LCDC bit 4
+// addressing mode points every cell at another tile, so it redraws them all.
+static void update_map_bitmaps(bool unsig) {
+	if (unsig != map_unsigned) {
+		map_unsigned = unsig;
+		for (int cell = 0; cell < 2048; cell++) {
+			mark_map_cell(cell);
+		}
+	}
+
+	load_tiles();
+
+	if (map_cells_dirty_count == 0) {
+		return;
+	}
+
+	for (int cell = 0; cell < 2048; cell++) {
+		if (!map_cell_dirty[cell]) {
+			continue;
+		}
+		map_cell_dirty[cell] = false;
+
+		u8 index = mem[0x9800 + cell];
+		int tile = unsig ? index : (signed char)index + 0x100;
+		int map = cell >> 10;
+		int x = (cell & 31) * 8;
+		int y = ((cell >> 5) & 31) * 8;
+		for (int row = 0; row < 8; row++) {
+			memcpy(&map_bitmap[map][y + row][x], Tiles[tile][row], 8);
+		}
+	}
+	map_cells_dirty_count = 0;
+}
+
+// Rebuilds the per-line sprite lists from OAM. Like the PPU's OAM scan, each
+// line takes the first 10 sprites in OAM order whose rows cover it; X plays
+// no part in the selection.
+static void build_sprite_index(int height) {
+	memset(line_sprite_count, 0, sizeof(line_sprite_count));
+
+	for (int sprite = 0; sprite < 40; sprite++) {
+		const u8 *oam = &mem[0xFE00 + sprite * 4];
+		int top = oam[0] - 16;
+		bool yflip = BIT(6, oam[3]);
+
+		for (int y = top < 0 ? 0 : top; y < top + height && y < 144; y++) {
+			if (line_sprite_count[y] == 10) {
+				continue;
+			}
+			int row = yflip ? height - 1 - (y - top) : y - top;
+
+			struct line_sprite *entry = &line_sprites[y][line_sprite_count[y]++];
+			entry->x = oam[1];
+			entry->tile = height == 16 ? (oam[2] & 0xFE) | (row >> 3) : oam[2];
+			entry->row = row & 7;
+			entry->attributes = oam[3];
+		}
+	}
+
+	oam_dirty = false;
+	sprite_index_height = height;
+}
+
+// Brings every cache a line reads up to date, so that lines can be drawn
+// from several threads at once afterwards.
+static void update_caches(void) {
+	u8 lcdc = mem[0xFF40];
+	update_map_bitmaps(BIT(4, lcdc));
+
+	int height = BIT(2, lcdc) ? 16 : 8;
+	if (oam_dirty || height != sprite_index_height) {
+		build_sprite_index(height);
+	}
+}
+
+#pragma endregion
+
+#pragma region Line Rendering
+
+// Draws pixels [x0, x1) of a line from row map_y of a map bitmap. Pixel x0
+// shows column map_x, and the copy wraps around at the bitmap's right edge.
+static void copy_map_span(u8 *out, int map, int map_y, int map_x, int x0, int x1, u8 layer) {
+	const u8 *row = map_bitmap[map][map_y & 255];
+	map_x &= 255;
+
+	int count = x1 - x0;
+	int first = 256 - map_x < count ? 256 - map_x : count;
+	memcpy(out + x0, row + map_x, first);
+	memcpy(out + x0 + first, row, count - first);
+
+	if (layer) {
+		for (int x = x0; x < x1; x++) {
+			out[x] |= layer;
+		}
+	}
+}
+
+// Where the window starts on a line, 160 when it is not shown there. The
+// window covers everything right of WX - 7 once LY reaches WY.
+static int window_start(const struct ppu_line_state *state, int line) {
+	if (BIT(7, state->lcdc) && BIT(0, state->lcdc) && BIT(5, state->lcdc) && line >= state->wy && state->wx < 167) {
+		return state->wx < 7 ? 0 : state->wx - 7;
+	}
+	return 160;
+}
+
+// Background and window part of a line. "window_row" is the window's own
+// line counter, which only advances on lines the window was drawn on.
+static void render_bg_line(u8 *out, const struct ppu_line_state *state, int line, int window_row) {
+	// Check which tilemaps to render.
+	int map = BIT(3, state->lcdc);
+	int window_map = BIT(6, state->lcdc);
+	int start = window_start(state, line);
+
+	// Draw non-windowed component
+	copy_map_span(out, map, line + state->scy, state->scx, 0, start, LAYER_BG);
+
+	// Draw windowed component
+	if (start < 160) {
+		copy_map_span(out, window_map, window_row, start + 7 - state->wx, start, 160, LAYER_WINDOW);
+	}
+}
+
+// Composes the sprites on one line into "out", where 0 means no sprite. The
+// sprite with the lower X wins, then the lower OAM index, so they are drawn
+// from the lowest priority up and each row is merged 8 pixels at a time
+// through its opacity mask.
+static void render_sprites(int line, u8 *out) {
+	// Stable insertion sort on X, ties keep OAM order.
+	struct line_sprite order[10];
+	int count = line_sprite_count[line];
+	for (int i = 0; i < count; i++) {
+		struct line_sprite entry = line_sprites[line][i];
+		int j = i;
+		while (j > 0 && order[j - 1].x > entry.x) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = entry;
+	}
+
+	for (int i = count - 1; i >= 0; i--) {
+		const struct line_sprite *sprite = &order[i];
+		u8 layer = BIT(4, sprite->attributes) ? LAYER_OBJ1 : LAYER_OBJ0;
+		if (BIT(7, sprite->attributes)) {
+			layer |= PIXEL_BEHIND_BG;
+		}
+
+		// Byte i of the row is pixel i, so an X flip is a byte swap.
+		u64 pixels;
+		memcpy(&pixels, Tiles[sprite->tile][sprite->row], 8);
+		if (BIT(5, sprite->attributes)) {
+			pixels = __builtin_bswap64(pixels);
+		}
+
+		// 0xFF in every byte that holds a non-zero colour.
+		u64 opaque = ((pixels | (pixels >> 1)) & 0x0101010101010101ULL) * 0xFF;
+		if (!opaque) {
+			continue;
+		}
+		pixels |= layer * 0x0101010101010101ULL;
+
+		int x = sprite->x - 8;
+		if (x >= 0 && x <= 152) {
+			u64 below;
+			memcpy(&below, out + x, 8);
+			below = (below & ~opaque) | (pixels & opaque);
+			memcpy(out + x, &below, 8);
+		}
+		else {
+			// Partly off the left or right edge.
+			for (int p = 0; p < 8; p++) {
+				if (x + p >= 0 && x + p < 160 && ((opaque >> (8 * p)) & 1)) {
+					out[x + p] = (u8)(pixels >> (8 * p));
+				}
+			}
+		}
+	}
+}
+
+// Draws one line with the registers latched in drawing->lines[line]. Only
+// reads the caches, update_caches() has to be called first.
+static void render_line(int line, int window_row) {
+	const struct ppu_line_state *state = &drawing->lines[line];
+	u8 *out = drawing->pixels[line];
+
+	// LCD off or BG and window off, the line shows colour 0.
+	if (!BIT(7, state->lcdc) || !BIT(0, state->lcdc)) {
+		memset(out, LAYER_BG, 160);
+	}
+	else {
+		render_bg_line(out, state, line, window_row);
+	}
+
+	if (BIT(7, state->lcdc) && BIT(1, state->lcdc)) {
+		u8 sprites[160] = { 0 };
+		render_sprites(line, sprites);
+		composite_line(out, sprites, 160);
+	}
+}
+
+static void latch_line(int line) {
+	struct ppu_line_state *state = &drawing->lines[line];
+	state->lcdc = mem[0xFF40];
+	state->scy = mem[0xFF42];
+	state->scx = mem[0xFF43];
+	state->bgp = mem[0xFF47];
+	state->obp0 = mem[0xFF48];
+	state->obp1 = mem[0xFF49];
+	state->wy = mem[0xFF4A];
+	state->wx = mem[0xFF4B];
+}
+
+#pragma endregion
+
+#pragma region Journal Replay
+
+static void apply_write(const struct ppu_write *write) {
+	u16 address = write->address;
+	mem[address] = write->value;
+
+	// Tile data, flag the tile so load_tiles() decodes it again
+	if (address >= 0x8000 && address <= 0x97FF) {
+		int tile = (address - 0x8000) / 16;
+		if (!tile_dirty[tile]) {
+			tile_dirty[tile] = true;
+			tiles_dirty_count++;
+		}
+	}
+	// Tile maps, only the cell that changed has to be redrawn
+	else if (address >= 0x9800 && address <= 0x9FFF) {
+		mark_map_cell(address - 0x9800);
+	}
+	// OAM, the sprite index has to be rebuilt
+	else if (address >= 0xFE00 && address <= 0xFE9F) {
+		oam_dirty = true;
+	}
+}
+
+// Draws the lines before "line" that have not been drawn yet, one at a time
+// with the current state. LY going back below the lines drawn means a new
+// frame was started (LCD off or LY reset).
+static void draw_until(int line) {
+	if (lines_rendered > line) {
+		lines_rendered = 0;
+	}
+	if (lines_rendered == line) {
+		return;
+	}
+
+	update_caches();
+	for (; lines_rendered < line; lines_rendered++) {
+		if (lines_rendered == 0) {
+			window_line = 0;
+		}
+		latch_line(lines_rendered);
+		render_line(lines_rendered, window_line);
+		if (window_start(&drawing->lines[lines_rendered], lines_rendered) < 160) {
+			window_line++;
+		}
+	}
+}
+
+// Applies journal entries in order, drawing the lines each one comes after.
+// Entries made during VBlank (line 144 and up) come before the frame's first
+// line.
+static void replay(const struct journal *journal) {
+	for (int i = 0; i < journal->count; i++) {
+		const struct ppu_write *write = &journal->entries[i];
+		if (write->line < 144) {
+			draw_until(write->line);
+			drawing->mid_frame_writes++;
+		}
+		apply_write(write);
+	}
+}
+
+// Draws band "band" of "bands" of a frame that has one state for all its
+// lines.
+static void draw_band(int band, int bands) {
+	int y0 = 144 * band / bands;
+	int y1 = 144 * (band + 1) / bands;
+	const struct ppu_line_state *state = &drawing->lines[0];
+
+	for (int line = y0; line < y1; line++) {
+		// With one state for the frame the window shows on every line from
+		// WY down, so its counter follows from the line number.
+		render_line(line, line - state->wy);
+	}
+}
+
+static void draw_bands(void) {
+	int bands = pool.helper_count + 1;
+
+	update_caches();
+	latch_line(0);
+	for (int line = 1; line < 144; line++) {
+		drawing->lines[line] = drawing->lines[0];
+	}
+
+	if (bands == 1) {
+		draw_band(0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.bands_busy = pool.helper_count;
+	pool.band_generation++;
+	pthread_cond_broadcast(&pool.band_wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	draw_band(0, bands);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.bands_busy > 0) {
+		pthread_cond_wait(&pool.band_done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Replays a whole frame's journal into "drawing". A frame whose writes all
+// came before its first line is drawn in bands, anything else one line at a
+// time. A skipped frame only has its writes applied.
+static void draw_frame(const struct journal *journal, bool draw) {
+	if (!draw) {
+		for (int i = 0; i < journal->count; i++) {
+			apply_write(&journal->entries[i]);
+		}
+		lines_rendered = 0;
+		return;
+	}
+
+	bool mid_frame = false;
+	for (int i = 0; i < journal->count && !mid_frame; i++) {
+		mid_frame = journal->entries[i].line < 144;
+	}
+
+	if (mid_frame) {
+		replay(journal);
+		draw_until(144);
+	}
+	else {
+		for (int i = 0; i < journal->count; i++) {
+			apply_write(&journal->entries[i]);
+		}
+		draw_bands();
+	}
+	lines_rendered = 0;
+}
+
+#pragma endregion
+
+#pragma region Threads
+
+static void *helper_main(void *arg) {
+	int band = (int)(intptr_t)arg;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.quit && pool.band_generation == seen) {
+			pthread_cond_wait(&pool.band_wake, &pool.lock);
+		}
+		if (pool.quit) {
+			break;
+		}
+		seen = pool.band_generation;
+		int bands = pool.helper_count + 1;
+		pthread_mutex_unlock(&pool.lock);
+
+		draw_band(band, bands);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.bands_busy == 0) {
+			pthread_cond_signal(&pool.band_done);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void *render_main(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.quit && !pool.queued) {
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		}
+		if (pool.quit) {
+			break;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		draw_frame(replaying, pool.draw);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.queued = false;
+		pthread_cond_signal(&pool.idle);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+// Blocks until the renderer has finished the frame it was given.
+static void wait_idle(void) {
+	if (!pool.threaded) {
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	while (pool.queued) {
+		pthread_cond_wait(&pool.idle, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+#pragma endregion
+
+void ppu_init(const u8 *ram, int threads) {
+	memcpy(&mem[0x8000], &ram[0x8000], 0x2000);
+	memcpy(&mem[0xFE00], &ram[0xFE00], 0xA0);
+	memcpy(&mem[0xFF40], &ram[0xFF40], 0x0C);
+
+	// Decode everything once.
+	for (int tile = 0; tile < 384; tile++) {
+		tile_dirty[tile] = true;
+	}
+	tiles_dirty_count = 384;
+	for (int cell = 0; cell < 2048; cell++) {
+		mark_map_cell(cell);
+	}
+	oam_dirty = true;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pthread_cond_init(&pool.idle, NULL);
+	pthread_cond_init(&pool.band_wake, NULL);
+	pthread_cond_init(&pool.band_done, NULL);
+	pool.quit = false;
+	pool.queued = false;
+	pool.draw = false;
+	pool.helper_count = 0;
+	pool.threaded = false;
+
+	if (threads < 1) {
+		return;
+	}
+	if (pthread_create(&pool.render, NULL, render_main, NULL) != 0) {
+		return;
+	}
+	pool.threaded = true;
+
+	if (threads - 1 > PPU_MAX_THREADS) {
+		threads = PPU_MAX_THREADS + 1;
+	}
+	for (int i = 0; i < threads - 1; i++) {
+		// Band 0 is drawn by the render thread, helpers take 1..threads - 1.
+		if (pthread_create(&pool.helpers[i], NULL, helper_main, (void *)(intptr_t)(i + 1)) != 0) {
+			break;
+		}
+		pool.helper_count++;
+	}
+}
+
+void ppu_write(u16 address, u8 value, u8 line) {
+	struct journal *journal = filling;
+
+	if (journal->count == journal->size) {
+		if (journal->size >= JOURNAL_FLUSH_SIZE) {
+			// A deliberate degradation: the writes go straight into the
+			// renderer's memory without drawing the lines they follow, as
+			// the buffer those lines would go to still holds the previous
+			// frame. With the LCD off there are no lines to draw, but if it
+			// came back on before the flush, that frame's raster effects
+			// show with the state at the flush.
+			wait_idle();
+			for (int i = 0; i < journal->count; i++) {
+				apply_write(&journal->entries[i]);
+			}
+			journal->count = 0;
+		}
+		else {
+			int size = journal->size ? journal->size * 2 : 4096;
+			struct ppu_write *entries = realloc(journal->entries, size * sizeof(struct ppu_write));
+			if (!entries) {
+				perror("realloc");
+				exit(1);
+			}
+			journal->entries = entries;
+			journal->size = size;
+		}
+	}
+
+	struct ppu_write *entry = &journal->entries[journal->count++];
+	entry->address = address;
+	entry->value = value;
+	entry->line = line;
+}
+
+const struct ppu_output *ppu_end_frame(bool draw) {
+	// The previous frame has had a whole frame's time to finish.
+	wait_idle();
+
+	struct journal *journal = filling;
+	filling = replaying;
+	replaying = journal;
+	filling->count = 0;
+
+	// Without a render thread the frame is drawn now and shown right away.
+	if (!pool.threaded) {
+		if (draw) {
+			drawing->mid_frame_writes = 0;
+			draw_frame(replaying, true);
+			finished = drawing;
+		}
+		else {
+			draw_frame(replaying, false);
+		}
+		return finished;
+	}
+
+	// The frame just drawn becomes the one shown, a skipped one leaves the
+	// last drawn frame in place.
+	if (pool.draw) {
+		struct ppu_output *done = drawing;
+		drawing = finished;
+		finished = done;
+	}
+	drawing->mid_frame_writes = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.queued = true;
+	pool.draw = draw;
+	pthread_cond_signal(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	return finished;
+}
+
+void ppu_shutdown(void) {
+	wait_idle();
+
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_cond_broadcast(&pool.band_wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	if (pool.threaded) {
+		pthread_join(pool.render, NULL);
+	}
+	for (int i = 0; i < pool.helper_count; i++) {
+		pthread_join(pool.helpers[i], NULL);
+	}
+	pool.threaded = false;
+	pool.helper_count = 0;
+
+	for (int i = 0; i < 2; i++) {
+		free(journals[i].entries);
+		journals[i].entries = NULL;
+		journals[i].count = journals[i].size = 0;
+	}
+}
@@ -0,0 +1,71 @@
+/**
+ * Scanline renderer.
+ * The renderer keeps its own copy of VRAM, OAM and the LCD registers. The CPU
+ * side only journals the writes that change what the PPU draws, each with
+ * the line it happened on. At VBlank the journal is handed over and replayed
+ * against that copy, drawing every line with the state it was shown with.
+ * With render threads this happens while the CPU runs the next frame, and a
+ * frame without mid-frame writes is drawn as bands of lines in parallel.
+ */
+
+#pragma once
+
+#include "qol.h"
+
+// The PPU draws at native resolution, one byte per pixel: bits 0-1 hold the
+// colour index, bits 2-3 say which layer it came from and bit 4 marks a
+// sprite drawn behind BG. Palettes and upscaling are applied by the output
+// stage.
+#define PIXEL_COLOUR 0x03
+#define PIXEL_LAYER 0x0C
+#define LAYER_BG 0x00
+#define LAYER_WINDOW 0x04
+#define LAYER_OBJ0 0x08        // Sprite using OBP0
+#define LAYER_OBJ1 0x0C        // Sprite using OBP1
+#define PIXEL_BEHIND_BG 0x10   // Sprite attribute bit 7 (drawn behind BG colours 1-3)
+
+// The registers a line was drawn with.
+struct ppu_line_state {
+	u8 lcdc;
+	u8 scy;
+	u8 scx;
+	u8 wy;
+	u8 wx;
+	u8 bgp;
+	u8 obp0;
+	u8 obp1;
+};
+
+// A finished frame.
+struct ppu_output {
+	u8 pixels[144][160];
+	struct ppu_line_state lines[144];
+	int mid_frame_writes;   // Journaled writes that landed on a visible line
+};
+
+/**
+ * Copy the PPU's part of "ram" (VRAM, OAM, LCD registers) and start "threads"
+ * threads: one replays the journal, the others help it draw bands of lines.
+ * With 0 threads frames are drawn on the caller by ppu_end_frame().
+ */
+void ppu_init(const u8 *ram, int threads);
+
+/**
+ * Journal a write that changes VRAM, OAM or one of the LCD registers. "line"
+ * is LY at the time of the write.
+ */
+void ppu_write(u16 address, u8 value, u8 line);
+
+/**
+ * Called at VBlank. Hands the frame's journal to the renderer and returns the
+ * most recent finished frame. With render threads that is the previous
+ * frame, the one just ended is drawn while the CPU runs the next. Without
+ * "draw" the frame's writes are applied but no lines are drawn, for frames
+ * that are skipped.
+ */
+const struct ppu_output *ppu_end_frame(bool draw);
+
+/**
+ * Wait for the renderer, stop the threads and free the journals.
+ */
+void ppu_shutdown(void);
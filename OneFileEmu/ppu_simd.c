@@ -0,0 +1,303 @@
+/**
+ * Data-parallel kernels used by the PPU renderer (see ppu_simd.h).
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ppu.h"
+#include "ppu_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PPU_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define PPU_SIMD_X86 0
+#endif
+
+void (*decode_tiles)(const u8 *src, u8 *dst, int count) = decode_tiles_scalar;
+void (*composite_line)(u8 *line, const u8 *sprites, int count) = composite_line_scalar;
+
+static const char *simd_name = "scalar";
+
+#pragma region Tile Decoding
+
+// Reference decoder: pixel x of a row takes bit (7 - x) of each bitplane,
+// the low plane giving bit 0 of the colour index and the high plane bit 1.
+void decode_tiles_scalar(const u8 *src, u8 *dst, int count) {
+	for (int row = 0; row < count * 8; row++) {
+		u8 lo = src[2 * row];
+		u8 hi = src[2 * row + 1];
+		for (int x = 0; x < 8; x++) {
+			int bit = 7 - x;
+			dst[8 * row + x] = ((lo >> bit) & 1) | (((hi >> bit) & 1) << 1);
+		}
+	}
+}
+
+#if PPU_SIMD_X86
+
+// Takes a vector holding one row as [lo x8 | hi x8] and returns the 8 colour
+// indices in its low half.
+__attribute__((target("sse2")))
+static inline __m128i expand_row_sse2(__m128i planes) {
+	const __m128i bits = _mm_setr_epi8(
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m128i weights = _mm_setr_epi8(1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2);
+
+	__m128i set = _mm_cmpeq_epi8(_mm_and_si128(planes, bits), bits);
+	set = _mm_and_si128(set, weights);
+	return _mm_or_si128(set, _mm_srli_si128(set, 8));
+}
+
+// Splats each bitplane byte across 8 lanes with three rounds of self-unpacks,
+// then decodes two rows per 16 byte store.
+__attribute__((target("sse2")))
+void decode_tiles_sse2(const u8 *src, u8 *dst, int count) {
+	for (int tile = 0; tile < count; tile++) {
+		__m128i raw = _mm_loadu_si128((const __m128i *)(src + 16 * tile));
+		__m128i quads[2] = { _mm_unpacklo_epi8(raw, raw), _mm_unpackhi_epi8(raw, raw) };
+
+		for (int q = 0; q < 2; q++) {
+			__m128i pairs[2] = {
+				_mm_unpacklo_epi16(quads[q], quads[q]),
+				_mm_unpackhi_epi16(quads[q], quads[q])
+			};
+
+			for (int p = 0; p < 2; p++) {
+				__m128i row_a = expand_row_sse2(_mm_unpacklo_epi32(pairs[p], pairs[p]));
+				__m128i row_b = expand_row_sse2(_mm_unpackhi_epi32(pairs[p], pairs[p]));
+				u8 *out = dst + 64 * tile + 16 * (2 * q + p);
+				_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi64(row_a, row_b));
+			}
+		}
+	}
+}
+
+// Broadcasts the 16 byte tile to both lanes and gathers each row's bitplane
+// byte into 8 lanes with a shuffle, giving four rows per 32 byte store.
+__attribute__((target("avx2")))
+void decode_tiles_avx2(const u8 *src, u8 *dst, int count) {
+	const __m256i bits = _mm256_setr_epi8(
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i two = _mm256_set1_epi8(2);
+	// Rows 0-3 come from bytes 0-7 of the tile, rows 4-7 from bytes 8-15.
+	const __m256i lo_rows[2] = {
+		_mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+			4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6),
+		_mm256_setr_epi8(8, 8, 8, 8, 8, 8, 8, 8, 10, 10, 10, 10, 10, 10, 10, 10,
+			12, 12, 12, 12, 12, 12, 12, 12, 14, 14, 14, 14, 14, 14, 14, 14)
+	};
+
+	for (int tile = 0; tile < count; tile++) {
+		__m256i raw = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(src + 16 * tile)));
+
+		for (int half = 0; half < 2; half++) {
+			__m256i lo = _mm256_shuffle_epi8(raw, lo_rows[half]);
+			__m256i hi = _mm256_shuffle_epi8(raw, _mm256_add_epi8(lo_rows[half], one));
+
+			lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits), one);
+			hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits), two);
+			_mm256_storeu_si256((__m256i *)(dst + 64 * tile + 32 * half), _mm256_or_si256(lo, hi));
+		}
+	}
+}
+
+#else
+
+void decode_tiles_sse2(const u8 *src, u8 *dst, int count) { decode_tiles_scalar(src, dst, count); }
+void decode_tiles_avx2(const u8 *src, u8 *dst, int count) { decode_tiles_scalar(src, dst, count); }
+
+#endif
+
+#pragma endregion
+
+#pragma region Line Compositing
+
+// Reference compositor, one pixel at a time.
+void composite_line_scalar(u8 *line, const u8 *sprites, int count) {
+	for (int x = 0; x < count; x++) {
+		u8 sprite = sprites[x];
+		if (sprite == 0) {
+			continue;
+		}
+		if ((sprite & PIXEL_BEHIND_BG) && (line[x] & PIXEL_COLOUR)) {
+			continue;
+		}
+		line[x] = sprite;
+	}
+}
+
+#if PPU_SIMD_X86
+
+// Sprite lanes win when they are non-zero and not hidden behind a BG pixel
+// with a non-zero colour; the result is a masked blend of the two lines.
+__attribute__((target("sse2")))
+static inline __m128i composite_sse2(__m128i bg, __m128i sprite) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i colour = _mm_set1_epi8(PIXEL_COLOUR);
+	const __m128i behind = _mm_set1_epi8(PIXEL_BEHIND_BG);
+
+	__m128i transparent = _mm_cmpeq_epi8(sprite, zero);
+	__m128i bg_clear = _mm_cmpeq_epi8(_mm_and_si128(bg, colour), zero);
+	__m128i in_front = _mm_cmpeq_epi8(_mm_and_si128(sprite, behind), zero);
+	// Keep the BG where the sprite is transparent or hidden.
+	__m128i keep = _mm_or_si128(transparent, _mm_andnot_si128(_mm_or_si128(in_front, bg_clear), _mm_cmpeq_epi8(zero, zero)));
+	return _mm_or_si128(_mm_and_si128(keep, bg), _mm_andnot_si128(keep, sprite));
+}
+
+__attribute__((target("sse2")))
+void composite_line_sse2(u8 *line, const u8 *sprites, int count) {
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m128i bg = _mm_loadu_si128((const __m128i *)(line + x));
+		__m128i sprite = _mm_loadu_si128((const __m128i *)(sprites + x));
+		_mm_storeu_si128((__m128i *)(line + x), composite_sse2(bg, sprite));
+	}
+	composite_line_scalar(line + x, sprites + x, count - x);
+}
+
+__attribute__((target("avx2")))
+void composite_line_avx2(u8 *line, const u8 *sprites, int count) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i colour = _mm256_set1_epi8(PIXEL_COLOUR);
+	const __m256i behind = _mm256_set1_epi8(PIXEL_BEHIND_BG);
+
+	int x = 0;
+	for (; x + 32 <= count; x += 32) {
+		__m256i bg = _mm256_loadu_si256((const __m256i *)(line + x));
+		__m256i sprite = _mm256_loadu_si256((const __m256i *)(sprites + x));
+
+		__m256i transparent = _mm256_cmpeq_epi8(sprite, zero);
+		__m256i bg_clear = _mm256_cmpeq_epi8(_mm256_and_si256(bg, colour), zero);
+		__m256i in_front = _mm256_cmpeq_epi8(_mm256_and_si256(sprite, behind), zero);
+		// A sprite pixel is hidden when it is behind and the BG is not clear.
+		__m256i hidden = _mm256_andnot_si256(_mm256_or_si256(in_front, bg_clear), _mm256_cmpeq_epi8(zero, zero));
+		__m256i keep = _mm256_or_si256(transparent, hidden);
+		_mm256_storeu_si256((__m256i *)(line + x), _mm256_blendv_epi8(sprite, bg, keep));
+	}
+	composite_line_sse2(line + x, sprites + x, count - x);
+}
+
+#else
+
+void composite_line_sse2(u8 *line, const u8 *sprites, int count) { composite_line_scalar(line, sprites, count); }
+void composite_line_avx2(u8 *line, const u8 *sprites, int count) { composite_line_scalar(line, sprites, count); }
+
+#endif
+
+#pragma endregion
+
+void ppu_simd_init(void) {
+#if PPU_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		decode_tiles = decode_tiles_avx2;
+		composite_line = composite_line_avx2;
+		simd_name = "avx2";
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		decode_tiles = decode_tiles_sse2;
+		composite_line = composite_line_sse2;
+		simd_name = "sse2";
+		return;
+	}
+#endif
+	decode_tiles = decode_tiles_scalar;
+	composite_line = composite_line_scalar;
+	simd_name = "scalar";
+}
+
+const char *ppu_simd_name(void) {
+	return simd_name;
+}
+
+#pragma region Self-test
+
+// xorshift32, so every run checks the same inputs.
+static u32 test_rand(u32 *state) {
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+struct kernel_set {
+	const char *name;
+	void (*decode)(const u8 *src, u8 *dst, int count);
+	void (*composite)(u8 *line, const u8 *sprites, int count);
+};
+
+static bool check_set(const struct kernel_set *set) {
+	static u8 src[48 * 16], want[48 * 64], got[48 * 64];
+	static u8 bg[200], sprites[200], line[200];
+	u32 seed = 0x2545F491;
+	bool ok = true;
+
+	for (int round = 0; round < 200; round++) {
+		int count = 1 + test_rand(&seed) % 48;
+		for (int i = 0; i < count * 16; i++) {
+			src[i] = (u8)test_rand(&seed);
+		}
+		decode_tiles_scalar(src, want, count);
+		set->decode(src, got, count);
+		if (memcmp(want, got, (size_t)count * 64) != 0) {
+			printf("decode_tiles_%s: %d tiles differ from scalar\n", set->name, count);
+			ok = false;
+			break;
+		}
+	}
+
+	// Every length up to past a line, so each kernel's tail is covered.
+	for (int count = 0; count <= 200; count++) {
+		for (int x = 0; x < count; x++) {
+			bg[x] = (u8)(test_rand(&seed) & 0x0F);
+			// Half the sprite pixels transparent, the rest with random flags.
+			sprites[x] = test_rand(&seed) & 1 ? 0 : (u8)(test_rand(&seed) & 0x1F);
+		}
+		memcpy(want, bg, count);
+		composite_line_scalar(want, sprites, count);
+		memcpy(line, bg, count);
+		set->composite(line, sprites, count);
+		if (memcmp(want, line, count) != 0) {
+			printf("composite_line_%s: %d pixels differ from scalar\n", set->name, count);
+			ok = false;
+			break;
+		}
+	}
+	return ok;
+}
+
+bool ppu_simd_selftest(void) {
+	const struct kernel_set sets[] = {
+		{ "sse2", decode_tiles_sse2, composite_line_sse2 },
+		{ "avx2", decode_tiles_avx2, composite_line_avx2 },
+	};
+#if PPU_SIMD_X86
+	__builtin_cpu_init();
+	const bool have[] = { __builtin_cpu_supports("sse2"), __builtin_cpu_supports("avx2") };
+#else
+	const bool have[] = { false, false };
+#endif
+	bool ok = true;
+
+	for (int i = 0; i < 2; i++) {
+		if (!have[i]) {
+			printf("PPU %s: not supported here, skipped\n", sets[i].name);
+			continue;
+		}
+		bool passed = check_set(&sets[i]);
+		printf("PPU %s: %s\n", sets[i].name, passed ? "matches scalar" : "FAILED");
+		ok = ok && passed;
+	}
+	return ok;
+}
+
+#pragma endregion
@@ -0,0 +1,52 @@
+/**
+ * Data-parallel kernels used by the PPU renderer.
+ * Every kernel has a plain C reference version; the SSE2/AVX2 versions are
+ * picked at runtime by ppu_simd_init() depending on what the host CPU has.
+ */
+
+#pragma once
+
+#include "qol.h"
+
+/**
+ * Expand "count" consecutive tiles of raw VRAM tile data at "src" (16 bytes
+ * per tile, one low/high bitplane pair per row) into "dst" as 64 colour
+ * indices (0-3) per tile, stored row-major: dst[tile * 64 + y * 8 + x].
+ */
+extern void (*decode_tiles)(const u8 *src, u8 *dst, int count);
+
+void decode_tiles_scalar(const u8 *src, u8 *dst, int count);
+void decode_tiles_sse2(const u8 *src, u8 *dst, int count);
+void decode_tiles_avx2(const u8 *src, u8 *dst, int count);
+
+/**
+ * Merge a line of sprite pixels into a line of BG/window pixels, both in the
+ * PPU's pixel format from ppu.h (colour in bits 0-1, layer in bits 2-3,
+ * "behind BG" in bit 4). A sprite pixel of 0 is transparent; one flagged
+ * behind BG only shows where the BG colour is 0. Everything else takes the
+ * sprite pixel, so its layer bits pick the OBP0/OBP1 palette for the output
+ * stage.
+ */
+extern void (*composite_line)(u8 *line, const u8 *sprites, int count);
+
+void composite_line_scalar(u8 *line, const u8 *sprites, int count);
+void composite_line_sse2(u8 *line, const u8 *sprites, int count);
+void composite_line_avx2(u8 *line, const u8 *sprites, int count);
+
+/**
+ * Detect the host's SIMD support and point the kernels above at the fastest
+ * implementation. Safe to call more than once.
+ */
+void ppu_simd_init(void);
+
+/**
+ * Name of the instruction set the kernels were bound to ("scalar", "sse2" or
+ * "avx2").
+ */
+const char *ppu_simd_name(void);
+
+/**
+ * Run every SIMD kernel the host supports against its scalar reference on
+ * random input, printing a line per instruction set. True if all matched.
+ */
+bool ppu_simd_selftest(void);
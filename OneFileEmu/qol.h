@@ -5,7 +5,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <math.h>
-#include <Windows.h>
 
 
 typedef uint8_t u8;
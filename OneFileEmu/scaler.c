@@ -0,0 +1,718 @@
+/**
+ * Output stage upscalers (see scaler.h).
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "scaler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCALER_X86 1
+#include <immintrin.h>
+#else
+#define SCALER_X86 0
+#endif
+
+#define SCALER_MAX_THREADS 16
+
+// Border replicated around the source so the neighbourhood filters can read
+// two pixels past every edge without bounds checks.
+#define PAD 2
+
+// Kernels scale source rows [y0, y1). "src" may be read up to PAD pixels
+// outside the image when it points into the padded copy.
+typedef void (*scaler_kernel)(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor);
+
+struct filter_info {
+	const char *name;
+	int factor;             // 0 when the filter takes any integer factor
+	bool padded;            // Needs the PAD border around the source
+	scaler_kernel scalar;
+	scaler_kernel simd;
+};
+
+struct scaler_job {
+	const struct filter_info *filter;
+	int scale;
+	const u32 *src;         // First image pixel, inside the padded copy if needed
+	int src_pitch;
+	int w, h;
+	u32 *stage;             // Filter output when a nearest pass follows it
+	int stage_pitch;
+	u32 *dst;
+	int dst_pitch;
+};
+
+static struct {
+	pthread_t threads[SCALER_MAX_THREADS];
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t finished;
+	unsigned generation;
+	int busy;
+	bool quit;
+} pool;
+
+static struct scaler_job job;
+
+// Scratch buffers, grown on demand.
+static u32 *padded;
+static size_t padded_size;
+static u32 *stage;
+static size_t stage_size;
+
+// Benchmark knobs: force the scalar kernels, or use fewer bands than threads.
+static bool use_simd = true;
+static int active_threads = -1;
+
+#pragma region Kernels
+
+static inline u32 blend(u32 a, u32 b) {
+	// Per channel (a + b + 1) / 2, same rounding as _mm_avg_epu8.
+	return (a | b) - (((a ^ b) & 0xFEFEFEFE) >> 1);
+}
+
+static inline int colour_dist(u32 a, u32 b) {
+	int dr = abs((int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF));
+	int dg = abs((int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF));
+	int db = abs((int)(a & 0xFF) - (int)(b & 0xFF));
+	return 2 * dr + 4 * dg + db;
+}
+
+static void copy_rows(u32 *row, int dst_pitch, int width, int count) {
+	for (int i = 1; i < count; i++) {
+		memcpy(row + i * dst_pitch, row, width * sizeof(u32));
+	}
+}
+
+static void nearest_scalar(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	for (int y = y0; y < y1; y++) {
+		const u32 *in = src + y * src_pitch;
+		u32 *row = dst + y * factor * dst_pitch;
+		u32 *out = row;
+		for (int x = 0; x < w; x++) {
+			for (int i = 0; i < factor; i++) {
+				*out++ = in[x];
+			}
+		}
+		copy_rows(row, dst_pitch, w * factor, factor);
+	}
+}
+
+static void scale2x_scalar(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	(void)factor;
+	for (int y = y0; y < y1; y++) {
+		u32 *out0 = dst + 2 * y * dst_pitch;
+		u32 *out1 = out0 + dst_pitch;
+		for (int x = 0; x < w; x++) {
+			const u32 *e = src + y * src_pitch + x;
+			u32 E = e[0], B = e[-src_pitch], D = e[-1], F = e[1], H = e[src_pitch];
+			u32 e0 = E, e1 = E, e2 = E, e3 = E;
+			if (B != H && D != F) {
+				e0 = D == B ? D : E;
+				e1 = B == F ? F : E;
+				e2 = D == H ? D : E;
+				e3 = H == F ? F : E;
+			}
+			out0[2 * x] = e0;
+			out0[2 * x + 1] = e1;
+			out1[2 * x] = e2;
+			out1[2 * x + 1] = e3;
+		}
+	}
+}
+
+static void scale3x_scalar(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	(void)factor;
+	for (int y = y0; y < y1; y++) {
+		u32 *out0 = dst + 3 * y * dst_pitch;
+		u32 *out1 = out0 + dst_pitch;
+		u32 *out2 = out1 + dst_pitch;
+		for (int x = 0; x < w; x++) {
+			const u32 *e = src + y * src_pitch + x;
+			u32 A = e[-src_pitch - 1], B = e[-src_pitch], C = e[-src_pitch + 1];
+			u32 D = e[-1], E = e[0], F = e[1];
+			u32 G = e[src_pitch - 1], H = e[src_pitch], I = e[src_pitch + 1];
+			u32 p[9] = { E, E, E, E, E, E, E, E, E };
+			if (B != H && D != F) {
+				p[0] = D == B ? D : E;
+				p[1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+				p[2] = B == F ? F : E;
+				p[3] = (D == B && E != G) || (D == H && E != A) ? D : E;
+				p[5] = (B == F && E != I) || (H == F && E != C) ? F : E;
+				p[6] = D == H ? D : E;
+				p[7] = (D == H && E != I) || (H == F && E != G) ? H : E;
+				p[8] = H == F ? F : E;
+			}
+			memcpy(out0 + 3 * x, p, 3 * sizeof(u32));
+			memcpy(out1 + 3 * x, p + 3, 3 * sizeof(u32));
+			memcpy(out2 + 3 * x, p + 6, 3 * sizeof(u32));
+		}
+	}
+}
+
+// Bottom-right corner of the xBR lv1 rule; "sx"/"sy" of -1 mirror it onto the
+// other three corners. An edge running along F-H wins when the colour
+// distances across it are smaller than the ones along it.
+static inline u32 xbr_corner(const u32 *e, int pitch, int sx, int sy) {
+#define P(dx, dy) e[(dy) * sy * pitch + (dx) * sx]
+	u32 E = P(0, 0), B = P(0, -1), C = P(1, -1), D = P(-1, 0), F = P(1, 0);
+	u32 G = P(-1, 1), H = P(0, 1), I = P(1, 1);
+	u32 F4 = P(2, 0), I4 = P(2, 1), H5 = P(0, 2), I5 = P(1, 2);
+#undef P
+	int along = colour_dist(E, C) + colour_dist(E, G) + colour_dist(I, H5) +
+		colour_dist(I, F4) + 4 * colour_dist(H, F);
+	int across = colour_dist(H, D) + colour_dist(H, I5) + colour_dist(F, I4) +
+		colour_dist(F, B) + 4 * colour_dist(E, I);
+	if (along < across) {
+		return blend(E, colour_dist(E, F) <= colour_dist(E, H) ? F : H);
+	}
+	return E;
+}
+
+static void xbr_scalar(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	(void)factor;
+	for (int y = y0; y < y1; y++) {
+		u32 *out0 = dst + 2 * y * dst_pitch;
+		u32 *out1 = out0 + dst_pitch;
+		for (int x = 0; x < w; x++) {
+			const u32 *e = src + y * src_pitch + x;
+			out0[2 * x] = xbr_corner(e, src_pitch, -1, -1);
+			out0[2 * x + 1] = xbr_corner(e, src_pitch, 1, -1);
+			out1[2 * x] = xbr_corner(e, src_pitch, -1, 1);
+			out1[2 * x + 1] = xbr_corner(e, src_pitch, 1, 1);
+		}
+	}
+}
+
+#if SCALER_X86
+
+#define LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+
+__attribute__((target("sse2")))
+static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+__attribute__((target("sse2")))
+static void nearest_sse2(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	for (int y = y0; y < y1; y++) {
+		const u32 *in = src + y * src_pitch;
+		u32 *row = dst + y * factor * dst_pitch;
+		int x = 0;
+
+		if (factor == 1) {
+			memcpy(row, in, w * sizeof(u32));
+			continue;
+		}
+		if (factor == 2) {
+			for (; x + 4 <= w; x += 4) {
+				__m128i v = LOAD(in + x);
+				STORE(row + 2 * x, _mm_unpacklo_epi32(v, v));
+				STORE(row + 2 * x + 4, _mm_unpackhi_epi32(v, v));
+			}
+		}
+		else {
+			// Splat each pixel and store it in 4 wide chunks. The last chunk
+			// spills into the next pixel's slot, which that pixel overwrites;
+			// the final pixel of the row is left to the scalar tail.
+			for (; x < w - 1; x++) {
+				__m128i v = _mm_set1_epi32((int)in[x]);
+				for (int i = 0; i < factor; i += 4) {
+					STORE(row + x * factor + i, v);
+				}
+			}
+		}
+		for (; x < w; x++) {
+			for (int i = 0; i < factor; i++) {
+				row[x * factor + i] = in[x];
+			}
+		}
+		copy_rows(row, dst_pitch, w * factor, factor);
+	}
+}
+
+__attribute__((target("sse2")))
+static void scale2x_sse2(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	const __m128i ones = _mm_set1_epi32(-1);
+	int vec_w = w & ~3;
+	for (int y = y0; y < y1; y++) {
+		u32 *out0 = dst + 2 * y * dst_pitch;
+		u32 *out1 = out0 + dst_pitch;
+		for (int x = 0; x < vec_w; x += 4) {
+			const u32 *e = src + y * src_pitch + x;
+			__m128i E = LOAD(e), B = LOAD(e - src_pitch), H = LOAD(e + src_pitch);
+			__m128i D = LOAD(e - 1), F = LOAD(e + 1);
+
+			__m128i active = _mm_andnot_si128(_mm_cmpeq_epi32(B, H),
+				_mm_andnot_si128(_mm_cmpeq_epi32(D, F), ones));
+			__m128i e0 = select_sse2(_mm_and_si128(active, _mm_cmpeq_epi32(D, B)), D, E);
+			__m128i e1 = select_sse2(_mm_and_si128(active, _mm_cmpeq_epi32(B, F)), F, E);
+			__m128i e2 = select_sse2(_mm_and_si128(active, _mm_cmpeq_epi32(D, H)), D, E);
+			__m128i e3 = select_sse2(_mm_and_si128(active, _mm_cmpeq_epi32(H, F)), F, E);
+
+			STORE(out0 + 2 * x, _mm_unpacklo_epi32(e0, e1));
+			STORE(out0 + 2 * x + 4, _mm_unpackhi_epi32(e0, e1));
+			STORE(out1 + 2 * x, _mm_unpacklo_epi32(e2, e3));
+			STORE(out1 + 2 * x + 4, _mm_unpackhi_epi32(e2, e3));
+		}
+	}
+	if (vec_w < w) {
+		// Leftover columns go through the scalar kernel on a shifted view.
+		for (int y = y0; y < y1; y++) {
+			scale2x_scalar(src + vec_w, src_pitch, w - vec_w, y, y + 1, dst + 2 * vec_w, dst_pitch, 2);
+		}
+	}
+	(void)factor;
+}
+
+// Interleaves three vectors of four pixels into twelve consecutive pixels.
+__attribute__((target("sse2")))
+static inline void store3_sse2(u32 *out, __m128i a, __m128i b, __m128i c) {
+	__m128 ab_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(a, b));
+	__m128 ab_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(a, b));
+	__m128 bc_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(b, c));
+	__m128 bc_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(b, c));
+	__m128 ca_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(c, a));
+	__m128 ca_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(c, a));
+	STORE(out, _mm_castps_si128(_mm_shuffle_ps(ab_lo, ca_lo, _MM_SHUFFLE(3, 0, 1, 0))));
+	STORE(out + 4, _mm_castps_si128(_mm_shuffle_ps(bc_lo, ab_hi, _MM_SHUFFLE(1, 0, 3, 2))));
+	STORE(out + 8, _mm_castps_si128(_mm_shuffle_ps(ca_hi, bc_hi, _MM_SHUFFLE(3, 2, 3, 0))));
+}
+
+__attribute__((target("sse2")))
+static void scale3x_sse2(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	const __m128i ones = _mm_set1_epi32(-1);
+	int vec_w = w & ~3;
+	for (int y = y0; y < y1; y++) {
+		u32 *out0 = dst + 3 * y * dst_pitch;
+		u32 *out1 = out0 + dst_pitch;
+		u32 *out2 = out1 + dst_pitch;
+		for (int x = 0; x < vec_w; x += 4) {
+			const u32 *e = src + y * src_pitch + x;
+			__m128i A = LOAD(e - src_pitch - 1), B = LOAD(e - src_pitch), C = LOAD(e - src_pitch + 1);
+			__m128i D = LOAD(e - 1), E = LOAD(e), F = LOAD(e + 1);
+			__m128i G = LOAD(e + src_pitch - 1), H = LOAD(e + src_pitch), I = LOAD(e + src_pitch + 1);
+
+			__m128i active = _mm_andnot_si128(_mm_cmpeq_epi32(B, H),
+				_mm_andnot_si128(_mm_cmpeq_epi32(D, F), ones));
+			__m128i db = _mm_and_si128(active, _mm_cmpeq_epi32(D, B));
+			__m128i bf = _mm_and_si128(active, _mm_cmpeq_epi32(B, F));
+			__m128i dh = _mm_and_si128(active, _mm_cmpeq_epi32(D, H));
+			__m128i hf = _mm_and_si128(active, _mm_cmpeq_epi32(H, F));
+			__m128i ne_a = _mm_andnot_si128(_mm_cmpeq_epi32(E, A), ones);
+			__m128i ne_c = _mm_andnot_si128(_mm_cmpeq_epi32(E, C), ones);
+			__m128i ne_g = _mm_andnot_si128(_mm_cmpeq_epi32(E, G), ones);
+			__m128i ne_i = _mm_andnot_si128(_mm_cmpeq_epi32(E, I), ones);
+
+			__m128i p0 = select_sse2(db, D, E);
+			__m128i p1 = select_sse2(_mm_or_si128(_mm_and_si128(db, ne_c), _mm_and_si128(bf, ne_a)), B, E);
+			__m128i p2 = select_sse2(bf, F, E);
+			__m128i p3 = select_sse2(_mm_or_si128(_mm_and_si128(db, ne_g), _mm_and_si128(dh, ne_a)), D, E);
+			__m128i p5 = select_sse2(_mm_or_si128(_mm_and_si128(bf, ne_i), _mm_and_si128(hf, ne_c)), F, E);
+			__m128i p6 = select_sse2(dh, D, E);
+			__m128i p7 = select_sse2(_mm_or_si128(_mm_and_si128(dh, ne_i), _mm_and_si128(hf, ne_g)), H, E);
+			__m128i p8 = select_sse2(hf, F, E);
+
+			store3_sse2(out0 + 3 * x, p0, p1, p2);
+			store3_sse2(out1 + 3 * x, p3, E, p5);
+			store3_sse2(out2 + 3 * x, p6, p7, p8);
+		}
+	}
+	if (vec_w < w) {
+		for (int y = y0; y < y1; y++) {
+			scale3x_scalar(src + vec_w, src_pitch, w - vec_w, y, y + 1, dst + 3 * vec_w, dst_pitch, 3);
+		}
+	}
+	(void)factor;
+}
+
+// colour_dist() for four pixels at once. Absolute byte differences come from
+// two saturating subtracts, then one madd per pixel pair applies the weights.
+__attribute__((target("sse2")))
+static inline __m128i dist_sse2(__m128i a, __m128i b) {
+	const __m128i weights = _mm_setr_epi16(1, 4, 2, 0, 1, 4, 2, 0);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+	__m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(diff, zero), weights));
+	__m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(diff, zero), weights));
+	return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+		_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i xbr_corner_sse2(const u32 *e, int pitch, int sx, int sy) {
+#define P(dx, dy) LOAD(e + (dy) * sy * pitch + (dx) * sx)
+	__m128i E = P(0, 0), B = P(0, -1), C = P(1, -1), D = P(-1, 0), F = P(1, 0);
+	__m128i G = P(-1, 1), H = P(0, 1), I = P(1, 1);
+	__m128i F4 = P(2, 0), I4 = P(2, 1), H5 = P(0, 2), I5 = P(1, 2);
+#undef P
+	__m128i along = _mm_add_epi32(_mm_add_epi32(dist_sse2(E, C), dist_sse2(E, G)),
+		_mm_add_epi32(dist_sse2(I, H5), dist_sse2(I, F4)));
+	along = _mm_add_epi32(along, _mm_slli_epi32(dist_sse2(H, F), 2));
+	__m128i across = _mm_add_epi32(_mm_add_epi32(dist_sse2(H, D), dist_sse2(H, I5)),
+		_mm_add_epi32(dist_sse2(F, I4), dist_sse2(F, B)));
+	across = _mm_add_epi32(across, _mm_slli_epi32(dist_sse2(E, I), 2));
+
+	__m128i edge = _mm_cmplt_epi32(along, across);
+	__m128i prefer_h = _mm_cmpgt_epi32(dist_sse2(E, F), dist_sse2(E, H));
+	__m128i mixed = _mm_avg_epu8(E, select_sse2(prefer_h, H, F));
+	return select_sse2(edge, mixed, E);
+}
+
+__attribute__((target("sse2")))
+static void xbr_sse2(const u32 *src, int src_pitch, int w, int y0, int y1,
+	u32 *dst, int dst_pitch, int factor) {
+	int vec_w = w & ~3;
+	for (int y = y0; y < y1; y++) {
+		u32 *out0 = dst + 2 * y * dst_pitch;
+		u32 *out1 = out0 + dst_pitch;
+		for (int x = 0; x < vec_w; x += 4) {
+			const u32 *e = src + y * src_pitch + x;
+			__m128i tl = xbr_corner_sse2(e, src_pitch, -1, -1);
+			__m128i tr = xbr_corner_sse2(e, src_pitch, 1, -1);
+			__m128i bl = xbr_corner_sse2(e, src_pitch, -1, 1);
+			__m128i br = xbr_corner_sse2(e, src_pitch, 1, 1);
+			STORE(out0 + 2 * x, _mm_unpacklo_epi32(tl, tr));
+			STORE(out0 + 2 * x + 4, _mm_unpackhi_epi32(tl, tr));
+			STORE(out1 + 2 * x, _mm_unpacklo_epi32(bl, br));
+			STORE(out1 + 2 * x + 4, _mm_unpackhi_epi32(bl, br));
+		}
+	}
+	if (vec_w < w) {
+		for (int y = y0; y < y1; y++) {
+			xbr_scalar(src + vec_w, src_pitch, w - vec_w, y, y + 1, dst + 2 * vec_w, dst_pitch, 2);
+		}
+	}
+	(void)factor;
+}
+
+#undef LOAD
+#undef STORE
+
+#else
+
+#define nearest_sse2 nearest_scalar
+#define scale2x_sse2 scale2x_scalar
+#define scale3x_sse2 scale3x_scalar
+#define xbr_sse2 xbr_scalar
+
+#endif
+
+#pragma endregion
+
+static const struct filter_info filters[SCALER_COUNT] = {
+	{ "nearest", 0, false, nearest_scalar, nearest_sse2 },
+	{ "scale2x", 2, true, scale2x_scalar, scale2x_sse2 },
+	{ "scale3x", 3, true, scale3x_scalar, scale3x_sse2 },
+	{ "xbr", 2, true, xbr_scalar, xbr_sse2 },
+};
+
+int scaler_filter_from_name(const char *name) {
+	for (int i = 0; i < SCALER_COUNT; i++) {
+		if (strcmp(filters[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *scaler_filter_name(int filter) {
+	return filters[filter].name;
+}
+
+bool scaler_supports(int filter, int scale) {
+	if (filter < 0 || filter >= SCALER_COUNT || scale < 1) {
+		return false;
+	}
+	return filters[filter].factor == 0 || scale % filters[filter].factor == 0;
+}
+
+#pragma region Thread Pool
+
+// Runs one band of the current job: the filter over its source rows, then the
+// nearest pass over the rows that produced when the filter alone falls short
+// of the requested scale.
+static void run_band(int band, int bands) {
+	int y0 = job.h * band / bands;
+	int y1 = job.h * (band + 1) / bands;
+	const struct filter_info *f = job.filter;
+	scaler_kernel kernel = use_simd ? f->simd : f->scalar;
+
+	if (y0 == y1) {
+		return;
+	}
+	if (f->factor == 0 || f->factor == job.scale) {
+		kernel(job.src, job.src_pitch, job.w, y0, y1, job.dst, job.dst_pitch, job.scale);
+		return;
+	}
+
+	kernel(job.src, job.src_pitch, job.w, y0, y1, job.stage, job.stage_pitch, f->factor);
+	scaler_kernel nearest = use_simd ? filters[SCALER_NEAREST].simd : filters[SCALER_NEAREST].scalar;
+	nearest(job.stage, job.stage_pitch, job.stage_pitch, y0 * f->factor, y1 * f->factor,
+		job.dst, job.dst_pitch, job.scale / f->factor);
+}
+
+static void *worker_main(void *arg) {
+	int band = (int)(intptr_t)arg;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.quit && pool.generation == seen) {
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		}
+		if (pool.quit) {
+			break;
+		}
+		seen = pool.generation;
+		int bands = active_threads + 1;
+		pthread_mutex_unlock(&pool.lock);
+
+		if (band < bands) {
+			run_band(band, bands);
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0) {
+			pthread_cond_signal(&pool.finished);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+void scaler_init(int threads) {
+	if (threads > SCALER_MAX_THREADS) {
+		threads = SCALER_MAX_THREADS;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pthread_cond_init(&pool.finished, NULL);
+	pool.quit = false;
+	pool.count = 0;
+	for (int i = 0; i < threads; i++) {
+		// Band 0 is always run by the caller, workers take 1..threads.
+		if (pthread_create(&pool.threads[i], NULL, worker_main, (void *)(intptr_t)(i + 1)) != 0) {
+			break;
+		}
+		pool.count++;
+	}
+	active_threads = pool.count;
+}
+
+void scaler_shutdown(void) {
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < pool.count; i++) {
+		pthread_join(pool.threads[i], NULL);
+	}
+	pool.count = 0;
+
+	free(padded);
+	free(stage);
+	padded = stage = NULL;
+	padded_size = stage_size = 0;
+}
+
+#pragma endregion
+
+static u32 *reserve(u32 **buffer, size_t *size, size_t pixels) {
+	if (*size < pixels) {
+		free(*buffer);
+		*buffer = malloc(pixels * sizeof(u32));
+		*size = pixels;
+	}
+	return *buffer;
+}
+
+void scaler_run(int filter, int scale, const u32 *src, int w, int h, int src_pitch,
+	u32 *dst, int dst_pitch) {
+	const struct filter_info *f = &filters[filter];
+
+	job.filter = f;
+	job.scale = scale;
+	job.w = w;
+	job.h = h;
+	job.dst = dst;
+	job.dst_pitch = dst_pitch;
+	job.src = src;
+	job.src_pitch = src_pitch;
+
+	if (f->padded) {
+		// Copy the frame into the middle of a buffer with its edge pixels
+		// repeated PAD times on every side.
+		int pitch = w + 2 * PAD;
+		u32 *buf = reserve(&padded, &padded_size, (size_t)pitch * (h + 2 * PAD));
+		for (int y = -PAD; y < h + PAD; y++) {
+			const u32 *in = src + (y < 0 ? 0 : y >= h ? h - 1 : y) * src_pitch;
+			u32 *out = buf + (y + PAD) * pitch;
+			for (int x = 0; x < PAD; x++) {
+				out[x] = in[0];
+				out[PAD + w + x] = in[w - 1];
+			}
+			memcpy(out + PAD, in, w * sizeof(u32));
+		}
+		job.src = buf + PAD * pitch + PAD;
+		job.src_pitch = pitch;
+	}
+	if (f->factor != 0 && f->factor != scale) {
+		job.stage_pitch = w * f->factor;
+		job.stage = reserve(&stage, &stage_size, (size_t)job.stage_pitch * h * f->factor);
+	}
+
+	int bands = active_threads + 1;
+	if (bands == 1) {
+		run_band(0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.busy = pool.count;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	run_band(0, bands);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy > 0) {
+		pthread_cond_wait(&pool.finished, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+#pragma region Self-test
+
+// xorshift32, so every run checks the same inputs.
+static u32 test_rand(u32 *state) {
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// Runs one kernel of "f" on "src" into "dst", which is first filled with a
+// marker so writes outside the image show up as differences too.
+static void run_kernel(const struct filter_info *f, bool simd, const u32 *src, int src_pitch,
+	int w, int h, u32 *dst, int dst_pitch, size_t dst_pixels, int factor) {
+	for (size_t i = 0; i < dst_pixels; i++) {
+		dst[i] = 0xDEADBEEF;
+	}
+	(simd ? f->simd : f->scalar)(src, src_pitch, w, 0, h, dst, dst_pitch, factor);
+}
+
+bool scaler_selftest(void) {
+#if !SCALER_X86
+	printf("Scaler sse2: not built here, skipped\n");
+	return true;
+#else
+	static const u32 shades[4] = { 0xFFFFFF, 0xB4B4B4, 0x6E6E6E, 0x000000 };
+	enum { MAX_W = 37, MAX_H = 5, MAX_FACTOR = 5 };
+	static u32 src[(MAX_H + 2 * PAD) * (MAX_W + 2 * PAD)];
+	static u32 want[MAX_H * MAX_FACTOR * (MAX_W * MAX_FACTOR + 3)];
+	static u32 got[MAX_H * MAX_FACTOR * (MAX_W * MAX_FACTOR + 3)];
+	u32 seed = 0x2545F491;
+	bool ok = true;
+
+	// Every width up to past a few vectors, odd ones included, so each
+	// kernel's scalar tail columns are covered, on mostly the four shades so
+	// the equality tests take both branches.
+	for (int filter = 0; filter < SCALER_COUNT; filter++) {
+		const struct filter_info *f = &filters[filter];
+		bool passed = true;
+		for (int w = 1; w <= MAX_W && passed; w++) {
+			for (int round = 0; round < 4; round++) {
+				int h = 1 + test_rand(&seed) % MAX_H;
+				int pitch = w + 2 * PAD;
+				for (int i = 0; i < pitch * (h + 2 * PAD); i++) {
+					u32 r = test_rand(&seed);
+					src[i] = r & 0x70 ? shades[r & 3] : r >> 8;
+				}
+				int factor = f->factor ? f->factor : 1 + round % MAX_FACTOR;
+				int dst_pitch = w * factor + 3;
+				size_t pixels = (size_t)dst_pitch * h * factor;
+				const u32 *origin = src + PAD * pitch + PAD;
+				run_kernel(f, false, origin, pitch, w, h, want, dst_pitch, pixels, factor);
+				run_kernel(f, true, origin, pitch, w, h, got, dst_pitch, pixels, factor);
+				if (memcmp(want, got, pixels * sizeof(u32)) != 0) {
+					printf("%s_sse2: %dx%d at %dx differs from scalar\n", f->name, w, h, factor);
+					passed = false;
+					break;
+				}
+			}
+		}
+		printf("Scaler sse2 %s: %s\n", f->name, passed ? "matches scalar" : "FAILED");
+		ok = ok && passed;
+	}
+	return ok;
+#endif
+}
+
+#pragma endregion
+
+#pragma region Benchmark
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double time_filter(int filter, int scale, const u32 *src, u32 *dst, int frames) {
+	double start = now_ms();
+	for (int i = 0; i < frames; i++) {
+		scaler_run(filter, scale, src, 160, 144, 160, dst, 160 * scale);
+	}
+	return (now_ms() - start) / frames;
+}
+
+void scaler_benchmark(int scale, int frames) {
+	static const u32 shades[4] = { 0xFFFFFF, 0xB4B4B4, 0x6E6E6E, 0x000000 };
+	static u32 src[144 * 160];
+	int max_scale = scale > 3 ? scale : 3;
+	u32 *dst = malloc((size_t)160 * max_scale * 144 * max_scale * sizeof(u32));
+
+	// Diagonal bands and blocks, so the edge tests take both branches.
+	for (int y = 0; y < 144; y++) {
+		for (int x = 0; x < 160; x++) {
+			src[y * 160 + x] = shades[(((x / 3) ^ (y / 5)) + ((x * y) >> 6)) & 3];
+		}
+	}
+
+	int threads = pool.count;
+	printf("Scaler benchmark, %d frames each, %d worker threads\n", frames, threads);
+	printf("%-8s %5s %12s %12s %12s\n", "filter", "scale", "scalar ms", "simd ms", "pool ms");
+	for (int filter = 0; filter < SCALER_COUNT; filter++) {
+		int s = scaler_supports(filter, scale) ? scale : filters[filter].factor;
+
+		active_threads = 0;
+		use_simd = false;
+		double scalar = time_filter(filter, s, src, dst, frames);
+		use_simd = true;
+		double simd = time_filter(filter, s, src, dst, frames);
+		active_threads = threads;
+		double pooled = time_filter(filter, s, src, dst, frames);
+
+		printf("%-8s %5d %12.4f %12.4f %12.4f\n", filters[filter].name, s, scalar, simd, pooled);
+	}
+	free(dst);
+}
+
+#pragma endregion
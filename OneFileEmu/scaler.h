@@ -0,0 +1,64 @@
+/**
+ * Output stage upscalers.
+ * Turns the resolved 160x144 frame into the window sized image. Every filter
+ * has a plain C kernel and an SSE2 one, and the work is split into bands of
+ * rows that run across a small pool of worker threads.
+ */
+
+#pragma once
+
+#include "qol.h"
+
+enum scaler_filter {
+	SCALER_NEAREST,   // Integer pixel replication, any factor
+	SCALER_SCALE2X,   // AdvMAME Scale2x
+	SCALER_SCALE3X,   // AdvMAME Scale3x
+	SCALER_XBR,       // 2x edge-directed filter in the style of xBR lv1
+	SCALER_COUNT
+};
+
+/**
+ * Look up a filter by its command line name. Returns -1 if unknown.
+ */
+int scaler_filter_from_name(const char *name);
+
+const char *scaler_filter_name(int filter);
+
+/**
+ * Check that "filter" can produce an image "scale" times the input size.
+ * Fixed-factor filters are followed by a nearest pass, so the scale has to be
+ * a multiple of the filter's own factor.
+ */
+bool scaler_supports(int filter, int scale);
+
+/**
+ * Start "threads" worker threads (0 runs everything on the caller).
+ */
+void scaler_init(int threads);
+
+/**
+ * Upscale the XRGB8888 image "src" ("w" x "h" pixels, rows "src_pitch"
+ * pixels apart) by "scale" into "dst" (rows "dst_pitch" pixels apart).
+ * Blocks until every band is done.
+ */
+void scaler_run(int filter, int scale, const u32 *src, int w, int h, int src_pitch,
+	u32 *dst, int dst_pitch);
+
+/**
+ * Stop the worker threads and free the scratch buffers.
+ */
+void scaler_shutdown(void);
+
+/**
+ * Time every filter at "scale" (or at its own factor when "scale" is not a
+ * multiple of it) on a synthetic 160x144 frame and print the cost per frame
+ * of the scalar kernel, the SIMD kernel and the SIMD kernel on the pool.
+ */
+void scaler_benchmark(int scale, int frames);
+
+/**
+ * Run every filter's SSE2 kernel against its scalar one on random images of
+ * every width up to a few vectors, printing a line per filter. True if all
+ * matched.
+ */
+bool scaler_selftest(void);
@@ -0,0 +1,91 @@
+/**
+ * WAV file output (see wav.h).
+ */
+
+#include <string.h>
+
+#include "wav.h"
+
+#define WAV_HEADER_BYTES 44
+
+struct wav_file {
+	FILE *file;
+	int rate;
+	u64 frames;
+};
+
+// Everything in a WAV file is little endian, whatever the host.
+static void put_u16(u8 *at, u16 value) {
+	at[0] = value & 0xFF;
+	at[1] = value >> 8;
+}
+
+static void put_u32(u8 *at, u32 value) {
+	put_u16(at, value & 0xFFFF);
+	put_u16(at + 2, value >> 16);
+}
+
+// RIFF, a 16 byte PCM format chunk, then the data chunk's header.
+static void write_header(struct wav_file *wav) {
+	u8 header[WAV_HEADER_BYTES];
+	u32 data_bytes = (u32)(wav->frames * 4);
+
+	memcpy(header, "RIFF", 4);
+	put_u32(header + 4, WAV_HEADER_BYTES - 8 + data_bytes);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_u32(header + 16, 16);
+	put_u16(header + 20, 1);              // PCM
+	put_u16(header + 22, 2);              // Channels
+	put_u32(header + 24, wav->rate);
+	put_u32(header + 28, wav->rate * 4);  // Bytes per second
+	put_u16(header + 32, 4);              // Bytes per frame
+	put_u16(header + 34, 16);             // Bits per sample
+	memcpy(header + 36, "data", 4);
+	put_u32(header + 40, data_bytes);
+
+	fseek(wav->file, 0, SEEK_SET);
+	fwrite(header, sizeof(header), 1, wav->file);
+	fseek(wav->file, 0, SEEK_END);
+}
+
+struct wav_file *wav_open(const char *path, int rate) {
+	struct wav_file *wav = calloc(1, sizeof(*wav));
+	if (!wav) {
+		return NULL;
+	}
+	wav->file = fopen(path, "wb");
+	if (!wav->file) {
+		free(wav);
+		return NULL;
+	}
+	wav->rate = rate;
+	write_header(wav);
+	return wav;
+}
+
+void wav_write(struct wav_file *wav, const float *samples, unsigned frames) {
+	u8 out[1024 * 4];
+
+	while (frames > 0) {
+		unsigned n = frames < 1024 ? frames : 1024;
+		for (unsigned i = 0; i < n * 2; i++) {
+			float s = samples[i];
+			s = s > 1.0f ? 1.0f : s < -1.0f ? -1.0f : s;
+			put_u16(out + i * 2, (u16)(int16_t)lrintf(s * 32767.0f));
+		}
+		fwrite(out, 4, n, wav->file);
+		wav->frames += n;
+		samples += n * 2;
+		frames -= n;
+	}
+}
+
+u64 wav_frames(const struct wav_file *wav) {
+	return wav->frames;
+}
+
+void wav_close(struct wav_file *wav) {
+	write_header(wav);
+	fclose(wav->file);
+	free(wav);
+}
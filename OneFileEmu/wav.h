@@ -0,0 +1,31 @@
+/**
+ * WAV file output.
+ * Writes 16-bit stereo PCM from the APU's float frames as they come. The
+ * header's sizes are only known at the end and are filled in on close.
+ */
+
+#pragma once
+
+#include "qol.h"
+
+struct wav_file;
+
+/**
+ * Create "path" for "rate" Hz stereo audio. NULL if it can't be written.
+ */
+struct wav_file *wav_open(const char *path, int rate);
+
+/**
+ * Append "frames" stereo interleaved frames, clipped to -1..1.
+ */
+void wav_write(struct wav_file *wav, const float *samples, unsigned frames);
+
+/**
+ * Frames written so far.
+ */
+u64 wav_frames(const struct wav_file *wav);
+
+/**
+ * Fill in the header's sizes and close the file.
+ */
+void wav_close(struct wav_file *wav);